@@ -0,0 +1,324 @@
+#include "common.cpp"
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <iomanip>
+#include <sstream>
+
+// Load generator for chat_server. Connects binary clients to the lobby,
+// lets some of them send at a series of offered rates and reports, per
+// rate, the deliveries per second the clients received and the latency
+// from send to delivery. Run it against a server on another machine, or
+// pinned to other cores, for numbers that mean anything.
+//
+//   chat_bench [host] [port] [--clients=N] [--senders=N] [--size=BYTES]
+//              [--rates=MSGS_PER_SEC,...] [--duration=SEC]
+
+using bench_clock = std::chrono::steady_clock;
+
+// Every bench message starts with this tag and its send time, so replayed
+// history and other clients' chat are ignored
+static constexpr char BENCH_TAG[4] = {'B', 'N', 'C', 'H'};
+static constexpr size_t BENCH_HEADER_SIZE = sizeof(BENCH_TAG) + 8;
+
+inline uint64_t now_ns() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        bench_clock::now().time_since_epoch()).count());
+}
+
+// Latencies in microseconds, one bucket per microsecond up to MAX_US
+class LatencyHistogram {
+private:
+    static constexpr size_t MAX_US = 200000;
+    std::vector<uint64_t> counts_ = std::vector<uint64_t>(MAX_US + 1);
+    uint64_t total_ = 0;
+    uint64_t max_ = 0;
+
+public:
+    void record(uint64_t us) {
+        ++counts_[std::min<uint64_t>(us, MAX_US)];
+        ++total_;
+        max_ = std::max(max_, us);
+    }
+
+    void reset() {
+        std::fill(counts_.begin(), counts_.end(), 0);
+        total_ = 0;
+        max_ = 0;
+    }
+
+    uint64_t total() const { return total_; }
+    uint64_t max() const { return max_; }
+
+    uint64_t percentile(double p) const {
+        uint64_t rank = static_cast<uint64_t>(p * static_cast<double>(total_));
+        uint64_t seen = 0;
+        for (size_t us = 0; us < counts_.size(); ++us) {
+            seen += counts_[us];
+            if (seen > rank) {
+                return us;
+            }
+        }
+        return max_;
+    }
+};
+
+// One connection. All handlers run on the single io thread, so the shared
+// histogram needs no locking.
+class BenchClient {
+private:
+    tcp::socket socket_;
+    LatencyHistogram& latencies_;
+    size_t& disconnects_;
+    std::vector<char> read_buffer_ = std::vector<char>(16 * 1024); // grows for large frames
+    size_t read_end_ = 0;
+    std::string pending_;  // frames waiting for the current write
+    std::string writing_;
+    bool write_in_progress_ = false;
+
+public:
+    BenchClient(boost::asio::io_context& io_context, LatencyHistogram& latencies,
+                size_t& disconnects)
+        : socket_(io_context), latencies_(latencies), disconnects_(disconnects) {}
+
+    void connect(const tcp::resolver::results_type& endpoints) {
+        boost::asio::connect(socket_, endpoints);
+        socket_.set_option(tcp::no_delay(true));
+        append_frame(FrameType::hello, nullptr, 0);
+        flush();
+        do_read();
+    }
+
+    void send(size_t count, size_t size) {
+        std::string body(std::max(size, BENCH_HEADER_SIZE), 'x');
+        std::memcpy(&body[0], BENCH_TAG, sizeof(BENCH_TAG));
+        for (size_t i = 0; i < count; ++i) {
+            write_le(&body[sizeof(BENCH_TAG)], now_ns(), 8);
+            append_frame(FrameType::chat, body.data(), body.size());
+        }
+        flush();
+    }
+
+private:
+    void append_frame(FrameType type, const char* body, size_t length) {
+        char header[Message::HEADER_SIZE] = {static_cast<char>(Message::MAGIC),
+                                             static_cast<char>(Message::VERSION),
+                                             static_cast<char>(type), 0};
+        write_le(header + 4, length, 4);
+        pending_.append(header, sizeof(header));
+        pending_.append(body, length);
+    }
+
+    void flush() {
+        if (write_in_progress_ || pending_.empty()) {
+            return;
+        }
+        write_in_progress_ = true;
+        writing_.swap(pending_);
+        pending_.clear();
+        boost::asio::async_write(socket_, boost::asio::buffer(writing_),
+            [this](boost::system::error_code ec, std::size_t /*length*/) {
+                write_in_progress_ = false;
+                if (!ec) {
+                    flush();
+                }
+            });
+    }
+
+    void do_read() {
+        socket_.async_read_some(
+            boost::asio::buffer(read_buffer_.data() + read_end_, read_buffer_.size() - read_end_),
+            [this](boost::system::error_code ec, std::size_t length) {
+                if (ec) {
+                    ++disconnects_; // e.g. dropped by the server as a slow consumer
+                    return;
+                }
+                read_end_ += length;
+                parse_frames();
+                do_read();
+            });
+    }
+
+    void parse_frames() {
+        uint64_t now = now_ns();
+        size_t begin = 0;
+        while (read_end_ - begin >= Message::HEADER_SIZE) {
+            const char* frame = read_buffer_.data() + begin;
+            size_t length = static_cast<size_t>(read_le(frame + 4, 4));
+            if (read_end_ - begin < Message::HEADER_SIZE + length) {
+                if (Message::HEADER_SIZE + length > read_buffer_.size()) {
+                    read_buffer_.resize(Message::HEADER_SIZE + length);
+                }
+                break;
+            }
+
+            EnvelopeView envelope(frame + Message::HEADER_SIZE, length);
+            if (static_cast<FrameType>(frame[2]) == FrameType::envelope && envelope.valid() &&
+                envelope.payload_length() >= BENCH_HEADER_SIZE &&
+                std::memcmp(envelope.payload(), BENCH_TAG, sizeof(BENCH_TAG)) == 0) {
+                uint64_t sent = read_le(envelope.payload() + sizeof(BENCH_TAG), 8);
+                latencies_.record(now > sent ? (now - sent) / 1000 : 0);
+            }
+            begin += Message::HEADER_SIZE + length;
+        }
+        std::memmove(read_buffer_.data(), read_buffer_.data() + begin, read_end_ - begin);
+        read_end_ -= begin;
+    }
+};
+
+// Paces the senders in 1 ms ticks, carrying fractional messages over
+class Sender {
+private:
+    boost::asio::steady_timer timer_;
+    std::vector<BenchClient*> clients_;
+    size_t size_;
+    double per_tick_ = 0;
+    double credit_ = 0;
+    bool running_ = false;
+
+public:
+    Sender(boost::asio::io_context& io_context, std::vector<BenchClient*> clients, size_t size)
+        : timer_(io_context), clients_(std::move(clients)), size_(size) {}
+
+    void start(double rate) {
+        per_tick_ = rate / 1000.0 / static_cast<double>(clients_.size());
+        credit_ = 0;
+        running_ = true;
+        timer_.expires_after(std::chrono::milliseconds(1));
+        tick();
+    }
+
+    void stop() {
+        running_ = false;
+        timer_.cancel();
+    }
+
+private:
+    void tick() {
+        timer_.async_wait([this](boost::system::error_code ec) {
+            if (ec || !running_) {
+                return;
+            }
+            credit_ += per_tick_;
+            size_t count = static_cast<size_t>(credit_);
+            credit_ -= static_cast<double>(count);
+            if (count > 0) {
+                for (auto* client : clients_) {
+                    client->send(count, size_);
+                }
+            }
+            timer_.expires_at(timer_.expiry() + std::chrono::milliseconds(1));
+            tick();
+        });
+    }
+};
+
+// Runs fn on the io thread and waits for it
+template <typename Fn>
+void run_on(boost::asio::io_context& io_context, Fn fn) {
+    std::promise<void> done;
+    boost::asio::post(io_context, [&]() {
+        fn();
+        done.set_value();
+    });
+    done.get_future().wait();
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        std::string host = DEFAULT_HOST;
+        std::string port = std::to_string(DEFAULT_PORT);
+        size_t client_count = 50;
+        size_t sender_count = 5;
+        size_t size = 64;
+        unsigned duration = 3;
+        std::vector<double> rates = {1000, 5000, 20000, 50000, 100000};
+
+        std::vector<std::string> positional;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto eq = arg.find('=');
+            std::string name = arg.substr(0, eq);
+            std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+            if (name == "--clients") {
+                client_count = std::max<size_t>(1, std::stoul(value));
+            } else if (name == "--senders") {
+                sender_count = std::max<size_t>(1, std::stoul(value));
+            } else if (name == "--size") {
+                size = std::stoul(value);
+            } else if (name == "--duration") {
+                duration = static_cast<unsigned>(std::max<unsigned long>(1, std::stoul(value)));
+            } else if (name == "--rates") {
+                rates.clear();
+                std::stringstream list(value);
+                std::string rate;
+                while (std::getline(list, rate, ',')) {
+                    rates.push_back(std::stod(rate));
+                }
+            } else {
+                positional.push_back(arg);
+            }
+        }
+        if (positional.size() > 0) host = positional[0];
+        if (positional.size() > 1) port = positional[1];
+        sender_count = std::min(sender_count, client_count);
+
+        boost::asio::io_context io_context;
+        tcp::resolver resolver(io_context);
+        auto endpoints = resolver.resolve(host, port);
+
+        LatencyHistogram latencies;
+        size_t disconnects = 0;
+        std::vector<std::unique_ptr<BenchClient>> clients;
+        for (size_t i = 0; i < client_count; ++i) {
+            clients.push_back(std::make_unique<BenchClient>(io_context, latencies, disconnects));
+            clients.back()->connect(endpoints);
+        }
+        std::vector<BenchClient*> senders;
+        for (size_t i = 0; i < sender_count; ++i) {
+            senders.push_back(clients[i].get());
+        }
+        Sender sender(io_context, senders, size);
+
+        auto work = boost::asio::make_work_guard(io_context);
+        std::thread io_thread([&io_context]() { io_context.run(); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(500)); // join history
+
+        std::cout << client_count << " clients, " << sender_count << " senders, "
+                  << size << " byte messages, " << duration << " s per rate" << std::endl;
+        std::cout << std::setw(12) << "offered/s" << std::setw(14) << "delivered/s"
+                  << std::setw(10) << "p50_us" << std::setw(10) << "p99_us"
+                  << std::setw(10) << "p999_us" << std::setw(10) << "max_us"
+                  << std::setw(8) << "lost" << std::endl;
+
+        for (double rate : rates) {
+            run_on(io_context, [&]() {
+                latencies.reset();
+                sender.start(rate);
+            });
+            std::this_thread::sleep_for(std::chrono::seconds(duration));
+            run_on(io_context, [&]() { sender.stop(); });
+            std::this_thread::sleep_for(std::chrono::milliseconds(500)); // stragglers
+
+            run_on(io_context, [&]() {
+                std::cout << std::setw(12) << static_cast<uint64_t>(rate)
+                          << std::setw(14) << latencies.total() / duration
+                          << std::setw(10) << latencies.percentile(0.5)
+                          << std::setw(10) << latencies.percentile(0.99)
+                          << std::setw(10) << latencies.percentile(0.999)
+                          << std::setw(10) << latencies.max()
+                          << std::setw(8) << disconnects << std::endl;
+            });
+        }
+
+        work.reset();
+        io_context.stop();
+        io_thread.join();
+
+    } catch (std::exception& e) {
+        std::cerr << "Exception: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,109 +1,320 @@
 #include "common.cpp"
+#include <array>
 #include <cstdlib>
+#include <unordered_map>
 
 class ChatClient {
 private:
     boost::asio::io_context& io_context_;
     tcp::socket socket_;
+    WireFormat format_;
+    tcp::resolver::results_type endpoints_;
+    boost::asio::steady_timer reconnect_timer_;
+    bool closing_ = false; // only touched on the socket's strand
     Message read_msg_;
-    std::queue<Message> write_msgs_;
-    std::mutex write_mutex_;
+    size_t max_body_size_;
+    std::array<char, 4096> skip_buffer_;
+    std::queue<message_ptr> write_msgs_; // only touched on the socket's strand
+    std::vector<boost::asio::const_buffer> write_buffers_;
     std::atomic<bool> connected_{false};
-    std::atomic<bool> writing_{false};
+    bool reconnecting_ = false;
+    
+    // Per room, by id, and only touched on the socket's strand: its name,
+    // and the oldest and newest message shown so far. /history pages back
+    // from the oldest of the active room; a reconnect resumes the lobby
+    // after its newest. Other rooms have to be joined again.
+    struct Room {
+        std::string name;
+        uint64_t oldest_sequence = 0;
+        uint64_t newest_sequence = 0;
+    };
+    std::unordered_map<uint32_t, Room> rooms_;
+    uint32_t active_room_ = 0;
+    
+    static constexpr auto RECONNECT_DELAY = std::chrono::seconds(1);
+    
+    static constexpr size_t MAX_RETAINED_READ_BODY = 64 * 1024;
 
 public:
-    ChatClient(boost::asio::io_context& io_context)
-        : io_context_(io_context), socket_(io_context) {}
+    ChatClient(boost::asio::io_context& io_context, WireFormat format, size_t max_body_size)
+        : io_context_(io_context), socket_(boost::asio::make_strand(io_context)),
+          format_(format), reconnect_timer_(socket_.get_executor()),
+          max_body_size_(max_body_size) {}
     
     void connect(const tcp::resolver::results_type& endpoints) {
-        boost::asio::async_connect(socket_, endpoints,
+        endpoints_ = endpoints;
+        boost::asio::dispatch(socket_.get_executor(), [this]() { do_connect(); });
+    }
+    
+    void write(message_ptr msg) {
+        if (!connected_) {
+            std::cerr << "Not connected to server!" << std::endl;
+            return;
+        }
+        enqueue(std::move(msg));
+    }
+    
+    void close() {
+        connected_ = false;
+        boost::asio::post(socket_.get_executor(), [this]() {
+            closing_ = true;
+            reconnect_timer_.cancel();
+            socket_.close();
+        });
+    }
+    
+    bool is_connected() const { return connected_; }
+    
+    // Asks for up to count messages of the active room older than any
+    // shown so far
+    void request_history(uint32_t count) {
+        if (!connected_) {
+            std::cerr << "Not connected to server!" << std::endl;
+            return;
+        }
+        boost::asio::post(socket_.get_executor(), [this, count]() {
+            HistoryPage page;
+            page.sequence = rooms_[active_room_].oldest_sequence;
+            page.count = count;
+            char body[HistoryPage::SIZE];
+            page.encode(body);
+            
+            auto request = make_message();
+            request->type = FrameType::history_request;
+            request->assign_body(body, sizeof(body));
+            enqueue(request);
+        });
+    }
+
+private:
+    void do_connect() {
+        boost::asio::async_connect(socket_, endpoints_,
             [this](boost::system::error_code ec, tcp::endpoint) {
+                if (closing_) {
+                    return;
+                }
                 if (!ec) {
                     connected_ = true;
-                    std::cout << "\n=== Connected to Chat Server ===" << std::endl;
-                    std::cout << "Type your messages and press Enter. Type 'quit' to exit." << std::endl;
-                    std::cout << "=================================" << std::endl;
+                    active_room_ = 0;
+                    rooms_[0].name = "lobby";
+                    if (reconnecting_) {
+                        std::cout << "=== Reconnected to #lobby ===" << std::endl;
+                    } else {
+                        std::cout << "\n=== Connected to Chat Server ===" << std::endl;
+                        std::cout << "Type your messages and press Enter. Type 'quit' to exit." << std::endl;
+                        std::cout << "Type '/join room', '/switch room' or '/leave [room]' to change rooms." << std::endl;
+                        if (format_ == WireFormat::binary) {
+                            std::cout << "Type '/history [count]' to load earlier messages." << std::endl;
+                        }
+                        std::cout << "=================================" << std::endl;
+                    }
+                    reconnecting_ = true;
+                    if (format_ == WireFormat::binary) {
+                        send_hello();
+                    }
                     do_read_header();
                 } else {
                     std::cerr << "Connection failed: " << ec.message() << std::endl;
+                    schedule_reconnect();
                 }
             });
     }
     
-    void write(const Message& msg) {
-        if (!connected_) {
-            std::cerr << "Not connected to server!" << std::endl;
+    // Drops the connection and any unsent messages, then retries after a
+    // delay; the hello of the new connection resumes after the last
+    // message shown
+    void connection_lost() {
+        if (closing_ || !socket_.is_open()) {
             return;
         }
+        connected_ = false;
+        socket_.close();
+        write_msgs_ = {};
         
-        bool write_in_progress = writing_.exchange(true);
-        {
-            std::lock_guard<std::mutex> lock(write_mutex_);
-            write_msgs_.push(msg);
-        }
-        
-        if (!write_in_progress) {
-            do_write();
+        // The new connection starts out in the lobby only
+        for (auto it = rooms_.begin(); it != rooms_.end();) {
+            it = it->first == 0 ? std::next(it) : rooms_.erase(it);
         }
+        std::cerr << "Connection lost, reconnecting..." << std::endl;
+        schedule_reconnect();
     }
     
-    void close() {
-        connected_ = false;
-        boost::asio::post(io_context_, [this]() { socket_.close(); });
+    void schedule_reconnect() {
+        reconnect_timer_.expires_after(RECONNECT_DELAY);
+        reconnect_timer_.async_wait([this](boost::system::error_code ec) {
+            if (!ec && !closing_) {
+                do_connect();
+            }
+        });
+    }
+    
+    // Tells the server to use binary framing for this connection, and where
+    // to resume if it is a reconnect
+    void send_hello() {
+        uint64_t newest = rooms_[0].newest_sequence;
+        auto hello = make_message();
+        hello->type = FrameType::hello;
+        char body[8];
+        write_le(body, newest, 8);
+        hello->assign_body(body, newest != 0 ? sizeof(body) : 0);
+        enqueue(hello);
+    }
+    
+    void enqueue(message_ptr shared) {
+        boost::asio::post(socket_.get_executor(), [this, shared]() {
+            bool write_in_progress = !write_msgs_.empty();
+            write_msgs_.push(shared);
+            if (!write_in_progress) {
+                do_write();
+            }
+        });
     }
     
-    bool is_connected() const { return connected_; }
-
-private:
     void do_read_header() {
+        size_t header_size = format_ == WireFormat::binary ? Message::HEADER_SIZE
+                                                           : Message::LEGACY_HEADER_SIZE;
         boost::asio::async_read(socket_,
-            boost::asio::buffer(read_msg_.data, Message::HEADER_SIZE),
+            boost::asio::buffer(read_msg_.header, header_size),
             [this](boost::system::error_code ec, std::size_t /*length*/) {
-                if (!ec && read_msg_.decode_header()) {
+                // Server frames add a prefix on top of the body limit
+                size_t limit = 2 * max_body_size_;
+                bool valid = !ec && (format_ == WireFormat::binary
+                                         ? read_msg_.decode_header(limit)
+                                         : read_msg_.decode_legacy_header(read_msg_.header,
+                                                                          limit));
+                if (valid) {
                     do_read_body();
+                } else if (!ec && format_ == WireFormat::binary && Message::is_binary_header(read_msg_.header) &&
+                           static_cast<uint8_t>(read_msg_.header[1]) == Message::VERSION) {
+                    // A well-formed frame from a server with a larger --max-body-size:
+                    // skip it rather than drop the connection and fetch it again
+                    std::cerr << "Skipped a " << read_msg_.body_length << " byte message (limit "
+                              << limit << ", see --max-body-size)" << std::endl;
+                    skip_body(read_msg_.body_length);
                 } else {
-                    connected_ = false;
-                    socket_.close();
+                    connection_lost();
+                }
+            });
+    }
+    
+    void skip_body(size_t remaining) {
+        size_t chunk = std::min(remaining, skip_buffer_.size());
+        boost::asio::async_read(socket_,
+            boost::asio::buffer(skip_buffer_.data(), chunk),
+            [this, remaining, chunk](boost::system::error_code ec, std::size_t /*length*/) {
+                if (ec) {
+                    connection_lost();
+                } else if (remaining > chunk) {
+                    skip_body(remaining - chunk);
+                } else {
+                    do_read_header();
                 }
             });
     }
     
     void do_read_body() {
+        read_msg_.reserve_body();
         boost::asio::async_read(socket_,
             boost::asio::buffer(read_msg_.body(), read_msg_.body_length),
             [this](boost::system::error_code ec, std::size_t /*length*/) {
                 if (!ec) {
-                    std::cout << std::string(read_msg_.body(), read_msg_.body_length) 
-                             << std::endl;
+                    if (read_msg_.type == FrameType::envelope) {
+                        print_envelope(EnvelopeView(read_msg_.body(), read_msg_.body_length));
+                    } else if (read_msg_.type == FrameType::history_end) {
+                        print_history_end();
+                    } else if (read_msg_.type == FrameType::resume_gap) {
+                        print_resume_gap();
+                    } else if (read_msg_.type == FrameType::room_info) {
+                        handle_room_info();
+                    } else if (read_msg_.type == FrameType::chat) {
+                        std::cout << std::string(read_msg_.body(), read_msg_.body_length) 
+                                 << std::endl;
+                    }
+                    read_msg_.trim_body(MAX_RETAINED_READ_BODY);
                     do_read_header();
                 } else {
-                    connected_ = false;
-                    socket_.close();
+                    connection_lost();
                 }
             });
     }
     
-    void do_write() {
-        Message msg;
-        {
-            std::lock_guard<std::mutex> lock(write_mutex_);
-            if (write_msgs_.empty()) {
-                writing_ = false;
-                return;
-            }
-            msg = write_msgs_.front();
-            write_msgs_.pop();
+    // Binary servers send metadata, not text; render it like legacy servers do
+    void print_envelope(const EnvelopeView& envelope) {
+        if (!envelope.valid()) {
+            return;
+        }
+        Room& room = rooms_[envelope.room_id()];
+        if (room.oldest_sequence == 0 || envelope.sequence() < room.oldest_sequence) {
+            room.oldest_sequence = envelope.sequence();
         }
+        if (envelope.sequence() > room.newest_sequence) {
+            room.newest_sequence = envelope.sequence();
+        }
+        
+        char timestamp[64];
+        std::time_t seconds = static_cast<std::time_t>(envelope.timestamp_ns() / 1000000000ull);
+        size_t length = format_timestamp(seconds, timestamp, sizeof(timestamp));
         
-        boost::asio::async_write(socket_,
-            boost::asio::buffer(msg.data, msg.length()),
+        std::cout.write(timestamp, static_cast<std::streamsize>(length));
+        if (envelope.room_id() != 0) {
+            std::cout << "#" << room.name << " ";
+        }
+        std::cout << "Client " << envelope.sender_id() << ": ";
+        std::cout.write(envelope.payload(), static_cast<std::streamsize>(envelope.payload_length()));
+        std::cout << std::endl;
+    }
+    
+    void print_history_end() {
+        HistoryPage page;
+        if (!HistoryPage::decode(read_msg_.body(), read_msg_.body_length, page)) {
+            return;
+        }
+        // A page cut short by the server's read limit continues before its sequence
+        auto room = rooms_.find(active_room_);
+        if (room != rooms_.end() && page.sequence != 0 &&
+            (room->second.oldest_sequence == 0 || page.sequence < room->second.oldest_sequence)) {
+            room->second.oldest_sequence = page.sequence;
+        }
+        std::cout << "--- " << page.count << " earlier messages"
+                  << (page.sequence == 0 ? ", start of history" : "") << " ---" << std::endl;
+    }
+    
+    void handle_room_info() {
+        RoomInfo info;
+        if (!RoomInfo::decode(read_msg_.body(), read_msg_.body_length, info)) {
+            return;
+        }
+        if (info.event == RoomEvent::joined) {
+            rooms_[info.room_id] = Room{info.name};
+        } else if (info.event == RoomEvent::left) {
+            rooms_.erase(info.room_id);
+        } else if (info.event == RoomEvent::active) {
+            active_room_ = info.room_id;
+        }
+        std::cout << info.describe() << std::endl;
+    }
+    
+    void print_resume_gap() {
+        HistoryPage page;
+        if (!HistoryPage::decode(read_msg_.body(), read_msg_.body_length, page)) {
+            return;
+        }
+        std::cout << "--- " << page.count << " messages missed while disconnected ---" << std::endl;
+    }
+    
+    // The front of write_msgs_ stays queued until its write completes
+    void do_write() {
+        write_buffers_.clear();
+        write_msgs_.front()->append_buffers(format_, write_buffers_);
+        boost::asio::async_write(socket_, write_buffers_,
             [this](boost::system::error_code ec, std::size_t /*length*/) {
                 if (!ec) {
-                    do_write();
+                    write_msgs_.pop();
+                    if (!write_msgs_.empty()) {
+                        do_write();
+                    }
                 } else {
-                    connected_ = false;
-                    socket_.close();
-                    writing_ = false;
+                    connection_lost();
                 }
             });
     }
@@ -113,15 +324,29 @@ int main(int argc, char* argv[]) {
     try {
         std::string host = DEFAULT_HOST;
         std::string port = std::to_string(DEFAULT_PORT);
+        WireFormat format = WireFormat::binary;
+        size_t max_body_size = Message::DEFAULT_MAX_BODY_SIZE;
         
-        if (argc > 1) host = argv[1];
-        if (argc > 2) port = argv[2];
+        // [host] [port] [--legacy] [--max-body-size=N]
+        std::vector<std::string> positional;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--legacy") {
+                format = WireFormat::legacy;
+            } else if (arg.rfind("--max-body-size=", 0) == 0) {
+                max_body_size = std::stoul(arg.substr(16));
+            } else {
+                positional.push_back(arg);
+            }
+        }
+        if (positional.size() > 0) host = positional[0];
+        if (positional.size() > 1) port = positional[1];
         
         boost::asio::io_context io_context;
         tcp::resolver resolver(io_context);
         auto endpoints = resolver.resolve(host, port);
         
-        ChatClient client(io_context);
+        ChatClient client(io_context, format, max_body_size);
         client.connect(endpoints);
         
         // Run io_context in separate thread
@@ -132,23 +357,27 @@ int main(int argc, char* argv[]) {
         // Input handling in main thread
         std::string line;
         while (std::getline(std::cin, line)) {
-            if (!client.is_connected()) {
-                std::cout << "Disconnected from server. Exiting..." << std::endl;
-                break;
-            }
-            
             if (line == "quit" || line == "exit") {
                 break;
             }
             
             if (line.empty()) continue;
             
-            Message msg;
-            msg.body_length = std::min(line.length(), 
-                                     static_cast<size_t>(Message::MAX_BODY_SIZE));
-            std::memcpy(msg.body(), line.c_str(), msg.body_length);
-            msg.encode_header();
+            // "/history [count]" pages back through older messages
+            if (format == WireFormat::binary && line.rfind("/history", 0) == 0) {
+                long count = std::atol(line.c_str() + 8);
+                client.request_history(static_cast<uint32_t>(count > 0 ? count : 20));
+                continue;
+            }
+            
+            if (line.length() > max_body_size) {
+                std::cerr << "Message too long (" << line.length() << " bytes, limit "
+                          << max_body_size << ")" << std::endl;
+                continue;
+            }
             
+            auto msg = make_message();
+            msg->assign_body(line.data(), line.length());
             client.write(msg);
         }
         
@@ -10,40 +10,611 @@
 #include <mutex>
 #include <queue>
 #include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <ctime>
 
 using boost::asio::ip::tcp;
 
-// Message structure for communication
+// How a peer frames its messages on the wire
+enum class WireFormat : uint8_t {
+    unknown,
+    legacy, // 4 ASCII digits ("%4d") followed by the body
+    binary  // 8-byte binary header followed by the body
+};
+
+enum class FrameType : uint8_t {
+    chat = 1,            // client -> server: payload only
+    hello = 2,           // sent by binary clients right after connecting
+    envelope = 3,        // server -> client: Envelope fields, then the payload
+    history_request = 4, // client -> server: HistoryPage fields, what to fetch
+    history_end = 5,     // server -> client: HistoryPage fields, what was sent
+    resume_gap = 6,      // server -> client: HistoryPage fields, what was skipped
+    room_info = 7        // server -> client: RoomInfo fields
+};
+
+// Fixed-width little-endian integer access without libc calls
+inline void write_le(char* out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; ++i) {
+        out[i] = static_cast<char>(value >> (8 * i));
+    }
+}
+
+inline uint64_t read_le(const char* in, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; ++i) {
+        value |= static_cast<uint64_t>(static_cast<uint8_t>(in[i])) << (8 * i);
+    }
+    return value;
+}
+
+// Server-assigned metadata at the start of an envelope frame body:
+//   [0..7] sequence  [8..15] timestamp (ns since epoch)  [16..19] sender id
+//   [20..23] room id  [24..] payload
+struct Envelope {
+    static constexpr size_t SIZE = 24;
+    
+    uint64_t sequence = 0; // shared by all rooms, assigned when a room accepts it
+    uint64_t timestamp_ns = 0;
+    uint32_t sender_id = 0;
+    uint32_t room_id = 0;
+    
+    void encode(char* out) const {
+        write_le(out, sequence, 8);
+        write_le(out + 8, timestamp_ns, 8);
+        write_le(out + 16, sender_id, 4);
+        write_le(out + 20, room_id, 4);
+    }
+};
+
+// Body of history_request and history_end frames:
+//   [0..7] sequence  [8..11] count
+// A request asks for up to count messages older than sequence (0 = the
+// newest). The server answers with the envelope frames of the page, oldest
+// first, then a history_end carrying the oldest sequence it sent (0 if it
+// reached the start of history) and how many it sent.
+//
+// A hello may carry a u64 sequence: the last one the client has shown,
+// when it reconnects. It is then sent only the messages after it, or, if
+// those are no longer all in memory, a resume_gap whose sequence is the
+// first message that follows and count how many before it were skipped.
+struct HistoryPage {
+    static constexpr size_t SIZE = 12;
+    
+    uint64_t sequence = 0;
+    uint32_t count = 0;
+    
+    void encode(char* out) const {
+        write_le(out, sequence, 8);
+        write_le(out + 8, count, 4);
+    }
+    
+    static bool decode(const char* body, size_t length, HistoryPage& page) {
+        if (length < SIZE) {
+            return false;
+        }
+        page.sequence = read_le(body, 8);
+        page.count = static_cast<uint32_t>(read_le(body + 8, 4));
+        return true;
+    }
+};
+
+// What a room_info frame reports about one of the session's rooms
+enum class RoomEvent : uint8_t {
+    left = 0,    // no longer a member
+    joined = 1,  // now a member; its latest history follows
+    active = 2,  // chat messages sent from now on go to this room
+    refused = 3  // a join or leave was rejected (bad name, room limit, last room)
+};
+
+// Body of room_info frames:
+//   [0..3] room id  [4] RoomEvent  [5..] room name
+// Clients start out in the "lobby" room (id 0) without a notice. Rooms are
+// managed with chat text commands, "/join name", "/switch name" and
+// "/leave [name]", which legacy clients can send as well; they are told
+// the outcome as text. Envelopes carry the id of the room they were sent to.
+struct RoomInfo {
+    static constexpr size_t HEADER_SIZE = 5;
+    
+    uint32_t room_id = 0;
+    RoomEvent event = RoomEvent::joined;
+    std::string name;
+    
+    std::string encode() const {
+        std::string body(HEADER_SIZE, '\0');
+        write_le(&body[0], room_id, 4);
+        body[4] = static_cast<char>(event);
+        return body + name;
+    }
+    
+    static bool decode(const char* body, size_t length, RoomInfo& info) {
+        if (length < HEADER_SIZE) {
+            return false;
+        }
+        info.room_id = static_cast<uint32_t>(read_le(body, 4));
+        info.event = static_cast<RoomEvent>(body[4]);
+        info.name.assign(body + HEADER_SIZE, length - HEADER_SIZE);
+        return true;
+    }
+    
+    // The line shown to users, e.g. "*** joined #general"
+    std::string describe() const {
+        const char* verb = "refused";
+        switch (event) {
+        case RoomEvent::left: verb = "left"; break;
+        case RoomEvent::joined: verb = "joined"; break;
+        case RoomEvent::active: verb = "now talking in"; break;
+        case RoomEvent::refused: verb = "cannot join or leave"; break;
+        }
+        return std::string("*** ") + verb + " #" + name;
+    }
+};
+
+// Reads envelope fields and payload in place from a received frame body
+class EnvelopeView {
+private:
+    const char* body_;
+    size_t length_;
+
+public:
+    EnvelopeView(const char* body, size_t length) : body_(body), length_(length) {}
+    
+    bool valid() const { return length_ >= Envelope::SIZE; }
+    uint64_t sequence() const { return read_le(body_, 8); }
+    uint64_t timestamp_ns() const { return read_le(body_ + 8, 8); }
+    uint32_t sender_id() const { return static_cast<uint32_t>(read_le(body_ + 16, 4)); }
+    uint32_t room_id() const { return static_cast<uint32_t>(read_le(body_ + 20, 4)); }
+    const char* payload() const { return body_ + Envelope::SIZE; }
+    size_t payload_length() const { return length_ - Envelope::SIZE; }
+};
+
+// Writes "[Thu Oct 15 23:18:57 2026] " (ctime() layout) and returns its
+// length; thread-safe, unlike ctime()
+inline size_t format_timestamp(std::time_t time, char* out, size_t size) {
+    std::tm local{};
+#ifdef _WIN32
+    localtime_s(&local, &time);
+#else
+    localtime_r(&time, &local);
+#endif
+    return std::strftime(out, size, "[%a %b %e %H:%M:%S %Y] ", &local);
+}
+
+// Recycles message bodies in power-of-4 size classes (64 B .. 1 MiB), so a
+// short line takes a small slot and large bodies avoid malloc churn. Bodies
+// above the largest class are allocated exactly and never cached.
+//
+// Every thread has its own free lists, so acquire() and release() on one
+// thread take no lock. A pooled block records the thread cache it came
+// from in a header in front of it; a block released on another thread is
+// pushed onto that cache's lock-free remote list, which the owner takes
+// over the next time its own list for the class runs dry. A thread's cache
+// outlives the thread: it is handed to the next new thread, remote list
+// included, so a late release never touches freed memory.
+class BufferPool {
+public:
+    static constexpr size_t MIN_CLASS_SIZE = 64;
+    static constexpr size_t CLASS_COUNT = 8;
+    static constexpr size_t MAX_CACHED_BYTES_PER_CLASS = 256 * 1024; // per thread
+    
+    static BufferPool& instance() {
+        static BufferPool pool;
+        return pool;
+    }
+    
+    // Returns a block of at least size bytes and its actual capacity
+    char* acquire(size_t size, size_t& capacity) {
+        size_t index = class_index(size);
+        if (index == CLASS_COUNT) {
+            capacity = size;
+            return new char[size];
+        }
+        
+        capacity = class_size(index);
+        Cache* cache = local_cache();
+        if (cache) {
+            SizeClass& size_class = cache->classes[index];
+            if (!size_class.free) {
+                take_remote(size_class, MAX_CACHED_BYTES_PER_CLASS / capacity);
+            }
+            if (FreeBlock* block = size_class.free) {
+                size_class.free = block->next;
+                --size_class.count;
+                return reinterpret_cast<char*>(block);
+            }
+        }
+        char* raw = new char[HEADER_SIZE + capacity];
+        *reinterpret_cast<Cache**>(raw) = cache; // null after the thread's exit: never cached
+        return raw + HEADER_SIZE;
+    }
+    
+    // Capacity acquire() hands out for a request of size bytes
+    static size_t capacity_for(size_t size) {
+        size_t index = class_index(size);
+        return index == CLASS_COUNT ? size : class_size(index);
+    }
+    
+    void release(char* block, size_t capacity) {
+        size_t index = class_index(capacity);
+        if (index == CLASS_COUNT || class_size(index) != capacity) {
+            delete[] block;
+            return;
+        }
+        
+        Cache* owner = *reinterpret_cast<Cache**>(block - HEADER_SIZE);
+        size_t max_blocks = MAX_CACHED_BYTES_PER_CLASS / capacity;
+        auto* free_block = reinterpret_cast<FreeBlock*>(block);
+        if (owner && owner == local_cache()) {
+            SizeClass& size_class = owner->classes[index];
+            if (size_class.count < max_blocks) {
+                free_block->next = size_class.free;
+                size_class.free = free_block;
+                ++size_class.count;
+                return;
+            }
+        } else if (owner) {
+            SizeClass& size_class = owner->classes[index];
+            if (size_class.remote_count.fetch_add(1, std::memory_order_relaxed) < max_blocks) {
+                free_block->next = size_class.remote.load(std::memory_order_relaxed);
+                while (!size_class.remote.compare_exchange_weak(free_block->next, free_block,
+                                                                std::memory_order_release,
+                                                                std::memory_order_relaxed)) {
+                }
+                return;
+            }
+            size_class.remote_count.fetch_sub(1, std::memory_order_relaxed);
+        }
+        delete[] (block - HEADER_SIZE);
+    }
+
+private:
+    // Keeps the block behind it as aligned as new[] made the allocation
+    static constexpr size_t HEADER_SIZE = alignof(std::max_align_t);
+    
+    // A cached block's own bytes link it into a free list
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+    
+    struct SizeClass {
+        FreeBlock* free = nullptr; // owning thread only
+        size_t count = 0;
+        std::atomic<FreeBlock*> remote{nullptr}; // released by other threads
+        std::atomic<size_t> remote_count{0};
+    };
+    
+    struct Cache {
+        SizeClass classes[CLASS_COUNT];
+        Cache* next_idle = nullptr; // guarded by idle_mutex_
+    };
+    
+    // Binds a cache to the thread for its lifetime
+    struct CacheHandle {
+        Cache* cache;
+        CacheHandle() : cache(instance().adopt()) {}
+        ~CacheHandle() {
+            thread_exited() = true;
+            instance().retire(cache);
+        }
+    };
+    
+    // Caches of exited threads, waiting for a new thread. Never freed.
+    std::mutex idle_mutex_;
+    Cache* idle_ = nullptr;
+    
+    BufferPool() = default;
+    
+    // Trivially destructible, so still readable while the thread exits
+    static bool& thread_exited() {
+        thread_local bool exited = false;
+        return exited;
+    }
+    
+    // The calling thread's cache; null once its handle is gone
+    static Cache* local_cache() {
+        if (thread_exited()) {
+            return nullptr;
+        }
+        thread_local CacheHandle handle;
+        return handle.cache;
+    }
+    
+    Cache* adopt() {
+        std::lock_guard<std::mutex> lock(idle_mutex_);
+        if (!idle_) {
+            return new Cache();
+        }
+        Cache* cache = idle_;
+        idle_ = cache->next_idle;
+        return cache;
+    }
+    
+    // Frees the thread's own free lists; the remote ones wait for the next owner
+    void retire(Cache* cache) {
+        for (auto& size_class : cache->classes) {
+            while (FreeBlock* block = size_class.free) {
+                size_class.free = block->next;
+                delete[] (reinterpret_cast<char*>(block) - HEADER_SIZE);
+            }
+            size_class.count = 0;
+        }
+        std::lock_guard<std::mutex> lock(idle_mutex_);
+        cache->next_idle = idle_;
+        idle_ = cache;
+    }
+    
+    // Moves what other threads released into the owner's free list, up to
+    // max_blocks; the rest is freed
+    static void take_remote(SizeClass& size_class, size_t max_blocks) {
+        FreeBlock* block = size_class.remote.exchange(nullptr, std::memory_order_acquire);
+        size_t taken = 0;
+        for (FreeBlock* next; block; block = next, ++taken) {
+            next = block->next;
+            if (size_class.count < max_blocks) {
+                block->next = size_class.free;
+                size_class.free = block;
+                ++size_class.count;
+            } else {
+                delete[] (reinterpret_cast<char*>(block) - HEADER_SIZE);
+            }
+        }
+        size_class.remote_count.fetch_sub(taken, std::memory_order_relaxed);
+    }
+    
+    static size_t class_size(size_t index) { return MIN_CLASS_SIZE << (2 * index); }
+    
+    // Smallest class that fits size, or CLASS_COUNT if none does
+    static size_t class_index(size_t size) {
+        size_t index = 0;
+        while (index < CLASS_COUNT && class_size(index) < size) {
+            ++index;
+        }
+        return index;
+    }
+};
+
+// Move-only owner of a pooled block
+class PooledBuffer {
+private:
+    char* data_ = nullptr;
+    size_t capacity_ = 0;
+
+public:
+    PooledBuffer() = default;
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+    PooledBuffer(PooledBuffer&& other) noexcept
+        : data_(other.data_), capacity_(other.capacity_) {
+        other.data_ = nullptr;
+        other.capacity_ = 0;
+    }
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept {
+        if (this != &other) {
+            reset();
+            std::swap(data_, other.data_);
+            std::swap(capacity_, other.capacity_);
+        }
+        return *this;
+    }
+    ~PooledBuffer() { reset(); }
+    
+    // Ensures room for size bytes; existing contents are not preserved
+    void reserve(size_t size) {
+        if (size <= capacity_) {
+            return;
+        }
+        reset();
+        data_ = BufferPool::instance().acquire(size, capacity_);
+    }
+    
+    void reset() {
+        if (data_) {
+            BufferPool::instance().release(data_, capacity_);
+            data_ = nullptr;
+            capacity_ = 0;
+        }
+    }
+    
+    char* data() { return data_; }
+    const char* data() const { return data_; }
+    size_t capacity() const { return capacity_; }
+};
+
+// Message structure for communication. Bodies are variable length and live
+// in a pooled buffer; the headers are kept inline so a frame goes out as a
+// header + body gather pair.
+//
+// Server-built messages also carry per-format bytes that go between the
+// header and the body: binary peers get the Envelope fields, legacy peers a
+// "[timestamp] Client N: " text prefix. Both sit right behind their header,
+// so each format still needs only two buffers.
+//
+// Binary header layout (little-endian):
+//   [0] magic  [1] version  [2] type  [3] flags  [4..7] body length
+// The magic byte is never a space or digit, which is how the server tells a
+// binary peer from a legacy one by the first byte it sends. Legacy headers
+// are 4 ASCII digits, so legacy peers only ever see the first 9999 bytes.
 struct Message {
-    static constexpr size_t HEADER_SIZE = 4;
-    static constexpr size_t MAX_BODY_SIZE = 512;
+    static constexpr size_t HEADER_SIZE = 8;
+    static constexpr size_t LEGACY_HEADER_SIZE = 4;
+    static constexpr size_t LEGACY_MAX_BODY_SIZE = 9999;
+    static constexpr size_t MAX_LEGACY_PREFIX_SIZE = 96;
+    static constexpr size_t DEFAULT_MAX_BODY_SIZE = 1024 * 1024;
+    static constexpr uint8_t MAGIC = 0xC3;
+    static constexpr uint8_t VERSION = 1;
     
-    char data[HEADER_SIZE + MAX_BODY_SIZE];
+    char header[HEADER_SIZE + Envelope::SIZE];                     // + envelope
+    char legacy_header[LEGACY_HEADER_SIZE + MAX_LEGACY_PREFIX_SIZE]; // + text prefix
+    size_t envelope_length = 0;
+    size_t legacy_prefix_length = 0;
     size_t body_length = 0;
+    FrameType type = FrameType::chat;
+    uint8_t flags = 0;
+    uint64_t sequence = 0;
+    uint32_t room_id = 0;
     
     // Get pointer to body
-    const char* body() const { return data + HEADER_SIZE; }
-    char* body() { return data + HEADER_SIZE; }
+    const char* body() const { return body_.data(); }
+    char* body() { return body_.data(); }
+    
+    // Get total binary frame length
+    size_t length() const { return HEADER_SIZE + envelope_length + body_length; }
     
-    // Get total message length
-    size_t length() const { return HEADER_SIZE + body_length; }
+    // Turn this into an envelope frame carrying envelope's fields
+    void set_envelope(const Envelope& envelope) {
+        type = FrameType::envelope;
+        sequence = envelope.sequence;
+        room_id = envelope.room_id;
+        envelope.encode(header + HEADER_SIZE);
+        envelope_length = Envelope::SIZE;
+    }
+    
+    // Patch the sequence of an envelope frame in place
+    void set_sequence(uint64_t value) {
+        sequence = value;
+        write_le(header + HEADER_SIZE, value, 8);
+    }
     
-    // Encode header with body length
+    // Extend the text legacy peers see in front of the body
+    void append_legacy_prefix(const char* text, size_t length) {
+        length = std::min(length, MAX_LEGACY_PREFIX_SIZE - legacy_prefix_length);
+        std::memcpy(legacy_header + LEGACY_HEADER_SIZE + legacy_prefix_length, text, length);
+        legacy_prefix_length += length;
+    }
+    
+    // Make room for body_length bytes, e.g. before reading a body into body()
+    void reserve_body() { body_.reserve(body_length); }
+    
+    // Hand a large body back to the pool instead of keeping it for reuse
+    void trim_body(size_t max_retained) {
+        if (body_.capacity() > max_retained) {
+            body_.reset();
+        }
+    }
+    
+    // Copy in a body and encode the headers for it
+    void assign_body(const char* data, size_t length) {
+        body_length = length;
+        reserve_body();
+        if (length > 0) {
+            std::memcpy(body(), data, length);
+        }
+        encode_header();
+    }
+    
+    static bool is_binary_header(const char* header) {
+        return static_cast<uint8_t>(header[0]) == MAGIC;
+    }
+    
+    // Encode both the binary and the legacy header for body_length
     void encode_header() {
-        char header[HEADER_SIZE + 1] = "";
-        std::sprintf(header, "%4d", static_cast<int>(body_length));
-        std::memcpy(data, header, HEADER_SIZE);
+        auto* h = reinterpret_cast<uint8_t*>(header);
+        h[0] = MAGIC;
+        h[1] = VERSION;
+        h[2] = static_cast<uint8_t>(type);
+        h[3] = flags;
+        write_le(header + 4, envelope_length + body_length, 4);
+        
+        // Same text as sprintf("%4d"): right-aligned, space padded
+        size_t value = legacy_frame_body_length();
+        for (size_t i = LEGACY_HEADER_SIZE; i-- > 0;) {
+            bool blank = value == 0 && i != LEGACY_HEADER_SIZE - 1;
+            legacy_header[i] = blank ? ' ' : static_cast<char>('0' + value % 10);
+            value /= 10;
+        }
+    }
+    
+    // Decode the binary header to get type and body length
+    bool decode_header(size_t max_body_size) {
+        const auto* h = reinterpret_cast<const uint8_t*>(header);
+        if (h[0] != MAGIC || h[1] != VERSION) {
+            return false;
+        }
+        type = static_cast<FrameType>(h[2]);
+        flags = h[3];
+        envelope_length = 0;
+        body_length = static_cast<size_t>(read_le(header + 4, 4));
+        return body_length <= max_body_size;
+    }
+    
+    // Decode a legacy "%4d" header; legacy frames are always chat
+    bool decode_legacy_header(const char* text, size_t max_body_size) {
+        size_t value = 0;
+        bool seen_digit = false;
+        for (size_t i = 0; i < LEGACY_HEADER_SIZE; ++i) {
+            char c = text[i];
+            if (c == ' ' && !seen_digit) {
+                continue;
+            }
+            if (c < '0' || c > '9') {
+                return false;
+            }
+            value = value * 10 + static_cast<size_t>(c - '0');
+            seen_digit = true;
+        }
+        body_length = value;
+        type = FrameType::chat;
+        flags = 0;
+        legacy_prefix_length = 0;
+        return seen_digit && body_length <= max_body_size;
     }
     
-    // Decode header to get body length
-    bool decode_header() {
-        char header[HEADER_SIZE + 1] = "";
-        std::strncat(header, data, HEADER_SIZE);
-        body_length = std::atoi(header);
-        return body_length <= MAX_BODY_SIZE;
+    // Append the buffers that put this message on the wire in format
+    void append_buffers(WireFormat format,
+                        std::vector<boost::asio::const_buffer>& buffers) const {
+        if (format == WireFormat::legacy) {
+            size_t prefix = std::min(legacy_prefix_length, LEGACY_MAX_BODY_SIZE);
+            buffers.push_back(boost::asio::buffer(legacy_header, LEGACY_HEADER_SIZE + prefix));
+            buffers.push_back(boost::asio::buffer(body(), legacy_frame_body_length() - prefix));
+        } else {
+            buffers.push_back(boost::asio::buffer(header, HEADER_SIZE + envelope_length));
+            buffers.push_back(boost::asio::buffer(body(), body_length));
+        }
+    }
+
+private:
+    PooledBuffer body_;
+    
+    size_t legacy_frame_body_length() const {
+        return std::min(legacy_prefix_length + body_length, LEGACY_MAX_BODY_SIZE);
     }
 };
 
+// Messages are immutable once framed, so a single instance can be shared by
+// every queue that needs to send it
+using message_ptr = std::shared_ptr<const Message>;
+
+// Serves shared_ptr control blocks from BufferPool so that creating a
+// message does not hit the heap once the pool is warm
+template <typename T>
+struct PoolAllocator {
+    using value_type = T;
+    
+    PoolAllocator() = default;
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) {}
+    
+    T* allocate(size_t n) {
+        size_t capacity;
+        return reinterpret_cast<T*>(BufferPool::instance().acquire(n * sizeof(T), capacity));
+    }
+    
+    void deallocate(T* p, size_t n) {
+        BufferPool::instance().release(reinterpret_cast<char*>(p),
+                                       BufferPool::capacity_for(n * sizeof(T)));
+    }
+    
+    template <typename U>
+    bool operator==(const PoolAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>&) const { return false; }
+};
+
+inline std::shared_ptr<Message> make_message() {
+    return std::allocate_shared<Message>(PoolAllocator<Message>());
+}
+
 // Constants
 constexpr unsigned short DEFAULT_PORT = 8080;
 constexpr const char* DEFAULT_HOST = "127.0.0.1";
\ No newline at end of file
@@ -0,0 +1,1294 @@
+#pragma once
+
+#include "common.cpp"
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <stdexcept>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+// CRC-32C (Castagnoli), the checksum of every history log record. Uses the
+// SSE4.2 instruction when the build targets it, a lookup table otherwise.
+class Crc32c
+{
+public:
+    static uint32_t compute(const char *data, size_t length, uint32_t crc = 0)
+    {
+        crc = ~crc;
+#ifdef __SSE4_2__
+        for (; length >= 8; data += 8, length -= 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, data, 8);
+            crc = static_cast<uint32_t>(_mm_crc32_u64(crc, word));
+        }
+        for (; length > 0; ++data, --length)
+        {
+            crc = _mm_crc32_u8(crc, static_cast<uint8_t>(*data));
+        }
+#else
+        static const Table table;
+        for (; length > 0; ++data, --length)
+        {
+            crc = table.entries[(crc ^ static_cast<uint8_t>(*data)) & 0xff] ^ (crc >> 8);
+        }
+#endif
+        return ~crc;
+    }
+
+private:
+    struct Table
+    {
+        uint32_t entries[256];
+
+        Table()
+        {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t crc = i;
+                for (int bit = 0; bit < 8; ++bit)
+                {
+                    crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78u : 0);
+                }
+                entries[i] = crc;
+            }
+        }
+    };
+};
+
+// Counters the flusher updates, reported in the [stats] line
+struct HistoryLogStats
+{
+    std::atomic<uint64_t> records{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> fsyncs{0};
+    std::atomic<uint64_t> segments{0};
+    std::atomic<uint64_t> durable_sequence{0}; // highest sequence known on disk
+};
+
+// Result of a history log read: the messages, oldest first, and the
+// sequence to continue before for older ones, 0 if the room has none
+struct HistoryRead
+{
+    std::vector<message_ptr> messages;
+    uint64_t more_before = 0;
+};
+
+#ifndef _WIN32
+
+// Append-only write-ahead log of every delivered chat message, kept in
+// segment files "history-NNNNNNNNNN.log" under one directory. A segment is
+// closed and a new one started once it would exceed the segment size.
+//
+// Record layout (little-endian), back to back with no padding:
+//   [0..3] payload length  [4..7] CRC-32C of the payload  [8..] payload
+//   payload: envelope (24 B) | u16 legacy prefix length | prefix | body
+//
+// append() only encodes the records into an in-memory batch, so the caller
+// (a room draining its inbox) never waits for the disk. A background flusher
+// thread takes the whole batch, writes it and fdatasync()s once for all of
+// it (group commit), then publishes the last sequence it made durable.
+//
+// Next to each segment, "history-N.idx" holds a sparse index: {u64
+// sequence, u64 file offset} for every INDEX_INTERVAL-th record.
+// "checkpoint" names the newest segment, its durable length and last
+// sequence, and the sequence of each room's last record. Both are hints,
+// written without fsync and validated on load; the segments stay the source
+// of truth. Warm start only scans what was written after the checkpoint,
+// or the whole log if there is no usable one. Each room then reads its own
+// tail through read_before() when it is created.
+//
+// "rooms" lists the sequence of every room's first record as
+//   [0..3] room id  [4..11] first sequence  [12..15] CRC-32C of [0..11]
+// It is synced before the records it describes, so a read can trust it to
+// stop at a room's first record instead of walking back through the whole
+// log, and a room missing from it has no history. It is rebuilt by a full
+// scan if it is missing.
+//
+// With a retain_segments limit, the flusher deletes the oldest segments
+// once a new one starts. Rooms whose records were all in them are then
+// forgotten: rooms_, the checkpoint and a rewritten rooms file only list
+// rooms with retained records.
+//
+// Reads run on a reader thread of their own, one at a time, and scan at
+// most max_read_segments segments each; a read that hits the cap reports
+// where to continue. Callers get the result through a callback on that
+// thread, so no io thread ever waits for the disk.
+class HistoryLog
+{
+public:
+    using ReadCallback = std::function<void(HistoryRead)>;
+
+    static constexpr size_t RECORD_HEADER_SIZE = 8;
+    static constexpr size_t RECORD_FIXED_SIZE = Envelope::SIZE + 2;
+    static constexpr size_t INDEX_INTERVAL = 64;
+    static constexpr size_t INDEX_ENTRY_SIZE = 16;
+    static constexpr size_t CHECKPOINT_HEADER_SIZE = 28;
+    static constexpr size_t CHECKPOINT_ROOM_SIZE = 12;
+    static constexpr size_t ROOM_ENTRY_SIZE = 16;
+    static constexpr auto CHECKPOINT_INTERVAL = std::chrono::seconds(1);
+
+    // A batch this big is flushed without waiting for the interval; one
+    // MAX_PENDING_BYTES big makes append() wait for the flusher
+    static constexpr size_t GROUP_COMMIT_BYTES = 4 * 1024 * 1024;
+    static constexpr size_t MAX_PENDING_BYTES = 16 * GROUP_COMMIT_BYTES;
+
+    // Picks up an existing log in dir; new records go to a fresh segment
+    HistoryLog(const std::string &dir, uint64_t segment_bytes,
+               std::chrono::milliseconds flush_interval, size_t max_read_segments,
+               size_t retain_segments, HistoryLogStats &stats)
+        : dir_(dir), segment_bytes_(segment_bytes),
+          flush_interval_(flush_interval), max_read_segments_(std::max<size_t>(1, max_read_segments)),
+          retain_segments_(retain_segments), stats_(stats)
+    {
+        std::filesystem::create_directories(dir_);
+        next_segment_ = last_segment_index(dir_) + 1;
+        recover(load_rooms());
+        if (!open_rooms())
+        {
+            throw std::runtime_error("history log: cannot open " + dir_ + "/rooms");
+        }
+        flusher_ = std::thread([this]()
+                               { run_flusher(); });
+        reader_ = std::thread([this]()
+                              { run_reader(); });
+    }
+
+    HistoryLog(const HistoryLog &) = delete;
+    HistoryLog &operator=(const HistoryLog &) = delete;
+
+    // Drops reads not started yet and flushes whatever is still pending
+    ~HistoryLog()
+    {
+        {
+            std::lock_guard<std::mutex> lock(reader_mutex_);
+            reader_stopping_ = true;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_); // a reader may wait on durable_
+        }
+        reader_work_.notify_one();
+        durable_.notify_all();
+        reader_.join();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        work_.notify_one();
+        flusher_.join();
+        close_segment();
+        if (rooms_fd_ >= 0)
+        {
+            ::close(rooms_fd_);
+        }
+    }
+
+    // Highest sequence found on startup; new messages must be stamped above it
+    uint64_t recovered_sequence() const { return recovered_sequence_; }
+
+    // Whether room_id has any history, on disk or about to be
+    bool has_history(uint32_t room_id)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return rooms_.count(room_id) > 0;
+    }
+
+    // Queues a read of up to count messages of room_id older than sequence
+    // `before` (UINT64_MAX for the newest). done gets them, oldest first, on
+    // the reader thread once every record stamped before the read started
+    // is on disk, so it also finds messages still in the group commit batch.
+    void read_before(uint32_t room_id, uint64_t before, size_t count, ReadCallback done)
+    {
+        {
+            std::lock_guard<std::mutex> lock(reader_mutex_);
+            reads_.push_back(ReadRequest{room_id, before, count, std::move(done)});
+        }
+        reader_work_.notify_one();
+    }
+
+    // Stamps each message of a room's batch with the next sequence number
+    // and queues it. Stamping and queueing under the same lock keeps the log
+    // strictly in sequence order across rooms and cores.
+    void append(const std::vector<std::shared_ptr<Message>> &batch,
+                std::atomic<uint64_t> &sequence)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        space_.wait(lock, [this]()
+                    { return pending_.size() < MAX_PENDING_BYTES || failed_; });
+
+        size_t offset = pending_.size();
+        for (const auto &msg : batch)
+        {
+            msg->set_sequence(sequence.fetch_add(1, std::memory_order_relaxed) + 1);
+            if (!failed_)
+            {
+                encode(*msg);
+            }
+        }
+
+        if (!failed_ && !batch.empty())
+        {
+            // A batch is always from one room
+            auto room = rooms_.try_emplace(batch.front()->room_id,
+                                           RoomRange{batch.front()->sequence, 0});
+            if (room.second)
+            {
+                encode_room(batch.front()->room_id, batch.front()->sequence, pending_rooms_);
+            }
+            room.first->second.last = batch.back()->sequence;
+        }
+
+        size_t appended = failed_ ? 0 : batch.size();
+        bool full = pending_.size() >= GROUP_COMMIT_BYTES;
+        lock.unlock();
+        stats_.records.fetch_add(appended, std::memory_order_relaxed);
+        if (offset == 0 || full)
+        {
+            work_.notify_one();
+        }
+    }
+
+    static std::string segment_name(uint64_t index)
+    {
+        char name[40];
+        std::snprintf(name, sizeof(name), "history-%010llu.log",
+                      static_cast<unsigned long long>(index));
+        return name;
+    }
+
+    // Index of the newest segment in dir, 0 if there is none
+    static uint64_t last_segment_index(const std::string &dir)
+    {
+        uint64_t last = 0;
+        for (const auto &entry : std::filesystem::directory_iterator(dir))
+        {
+            unsigned long long index;
+            std::string name = entry.path().filename().string();
+            if (std::sscanf(name.c_str(), "history-%10llu.log", &index) == 1 &&
+                name == segment_name(index))
+            {
+                last = std::max<uint64_t>(last, index);
+            }
+        }
+        return last;
+    }
+
+private:
+    // A record to put in the sparse index, by its offset in the batch
+    struct IndexMark
+    {
+        size_t offset;
+        uint64_t sequence;
+    };
+
+    struct RoomRange
+    {
+        uint64_t first; // sequence of the room's first record
+        uint64_t last;  // and of its last
+    };
+
+    struct ReadRequest
+    {
+        uint32_t room_id;
+        uint64_t before;
+        size_t count;
+        ReadCallback done;
+    };
+
+    std::string dir_;
+    uint64_t segment_bytes_;
+    std::chrono::milliseconds flush_interval_;
+    size_t max_read_segments_;
+    size_t retain_segments_; // 0 keeps every segment
+    HistoryLogStats &stats_;
+
+    // Guarded by mutex_: the batch being filled, the offsets in it where a
+    // new segment starts, and the appender's view of the current segment
+    std::mutex mutex_;
+    std::condition_variable work_;
+    std::condition_variable space_;
+    std::vector<char> pending_;
+    std::vector<size_t> rollovers_;
+    std::vector<IndexMark> index_marks_;
+    std::vector<char> pending_rooms_; // "rooms" entries of rooms new in the batch
+    uint64_t pending_sequence_ = 0;
+    bool segment_started_ = false;
+    uint64_t segment_used_ = 0;
+    uint64_t segment_records_ = 0;
+    bool stopping_ = false;
+    bool failed_ = false;
+
+    // Guarded by mutex_
+    std::unordered_map<uint32_t, RoomRange> rooms_;
+
+    // Signalled, with mutex_ taken in between, when durable_sequence moves
+    std::condition_variable durable_;
+
+    // Flusher thread only
+    std::thread flusher_;
+    std::vector<char> flushing_;
+    std::vector<size_t> flushing_rollovers_;
+    std::vector<IndexMark> flushing_marks_;
+    std::vector<char> flushing_rooms_;
+    std::vector<char> index_buffer_;
+    std::vector<char> checkpoint_buffer_;
+    int segment_fd_ = -1;
+    int index_fd_ = -1;
+    int rooms_fd_ = -1;
+    uint64_t segment_offset_ = 0;
+    std::atomic<uint64_t> next_segment_;
+    uint64_t last_sequence_ = 0;
+    std::chrono::steady_clock::time_point last_checkpoint_;
+
+    // Reader thread and its queue
+    std::thread reader_;
+    std::mutex reader_mutex_;
+    std::condition_variable reader_work_;
+    std::deque<ReadRequest> reads_;
+    std::atomic<bool> reader_stopping_{false};
+
+    // Oldest segment on disk, 0 if there is none. Found by recover(), then
+    // only moved by the flusher as it starts and deletes segments.
+    std::atomic<uint64_t> first_segment_{0};
+
+    // Set by recover() before the flusher starts
+    uint64_t recovered_sequence_ = 0;
+
+    // Called with mutex_ held
+    void encode(const Message &msg)
+    {
+        size_t payload = RECORD_FIXED_SIZE + msg.legacy_prefix_length + msg.body_length;
+        size_t record = RECORD_HEADER_SIZE + payload;
+
+        // Segment boundaries are decided here, at record granularity, and
+        // carried to the flusher as marks into the batch
+        if (!segment_started_ || (segment_used_ > 0 && segment_used_ + record > segment_bytes_))
+        {
+            rollovers_.push_back(pending_.size());
+            segment_started_ = true;
+            segment_used_ = 0;
+            segment_records_ = 0;
+        }
+        if (segment_records_++ % INDEX_INTERVAL == 0)
+        {
+            index_marks_.push_back(IndexMark{pending_.size(), msg.sequence});
+        }
+        segment_used_ += record;
+
+        size_t offset = pending_.size();
+        pending_.resize(offset + record);
+        char *out = pending_.data() + offset;
+        char *body = out + RECORD_HEADER_SIZE;
+        std::memcpy(body, msg.header + Message::HEADER_SIZE, Envelope::SIZE);
+        write_le(body + Envelope::SIZE, msg.legacy_prefix_length, 2);
+        std::memcpy(body + RECORD_FIXED_SIZE,
+                    msg.legacy_header + Message::LEGACY_HEADER_SIZE, msg.legacy_prefix_length);
+        if (msg.body_length > 0)
+        {
+            std::memcpy(body + RECORD_FIXED_SIZE + msg.legacy_prefix_length,
+                        msg.body(), msg.body_length);
+        }
+        write_le(out, payload, 4);
+        write_le(out + 4, Crc32c::compute(body, payload), 4);
+        pending_sequence_ = msg.sequence;
+    }
+
+    void run_flusher()
+    {
+        for (;;)
+        {
+            uint64_t sequence;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                work_.wait(lock, [this]()
+                           { return stopping_ || !pending_.empty(); });
+                // Let the batch grow for one interval so its records share
+                // a single fdatasync
+                work_.wait_for(lock, flush_interval_, [this]()
+                               { return stopping_ || pending_.size() >= GROUP_COMMIT_BYTES; });
+                if (pending_.empty())
+                {
+                    lock.unlock();
+                    write_checkpoint(); // stopping
+                    return;
+                }
+                flushing_.swap(pending_);
+                flushing_rollovers_.swap(rollovers_);
+                flushing_marks_.swap(index_marks_);
+                flushing_rooms_.swap(pending_rooms_);
+                sequence = pending_sequence_;
+            }
+            space_.notify_all();
+
+            if (!write_batch())
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                failed_ = true;
+                space_.notify_all();
+                durable_.notify_all();
+                return;
+            }
+            stats_.durable_sequence.store(sequence, std::memory_order_release);
+            {
+                std::lock_guard<std::mutex> lock(mutex_); // no lost wakeup
+            }
+            durable_.notify_all();
+            last_sequence_ = sequence;
+            if (!flushing_rollovers_.empty())
+            {
+                retire_segments();
+            }
+            if (!flushing_rollovers_.empty() ||
+                std::chrono::steady_clock::now() - last_checkpoint_ >= CHECKPOINT_INTERVAL)
+            {
+                write_checkpoint();
+            }
+            flushing_.clear();
+            flushing_rollovers_.clear();
+            flushing_marks_.clear();
+            flushing_rooms_.clear();
+        }
+    }
+
+    bool write_batch()
+    {
+        // New rooms are made durable before their first records
+        if (!flushing_rooms_.empty() &&
+            (!write_all(rooms_fd_, flushing_rooms_.data(), flushing_rooms_.size()) ||
+             !sync(rooms_fd_)))
+        {
+            return false;
+        }
+
+        size_t begin = 0;
+        size_t next_rollover = 0;
+        size_t next_mark = 0;
+        while (begin < flushing_.size())
+        {
+            if (next_rollover < flushing_rollovers_.size() &&
+                flushing_rollovers_[next_rollover] == begin)
+            {
+                if (!open_next_segment())
+                {
+                    return false;
+                }
+                ++next_rollover;
+            }
+            size_t end = next_rollover < flushing_rollovers_.size()
+                             ? flushing_rollovers_[next_rollover]
+                             : flushing_.size();
+            if (!write_all(segment_fd_, flushing_.data() + begin, end - begin))
+            {
+                return false;
+            }
+
+            // The index is only a hint, so it is written but never synced
+            index_buffer_.clear();
+            for (; next_mark < flushing_marks_.size() && flushing_marks_[next_mark].offset < end;
+                 ++next_mark)
+            {
+                char entry[INDEX_ENTRY_SIZE];
+                write_le(entry, flushing_marks_[next_mark].sequence, 8);
+                write_le(entry + 8, segment_offset_ + flushing_marks_[next_mark].offset - begin, 8);
+                index_buffer_.insert(index_buffer_.end(), entry, entry + INDEX_ENTRY_SIZE);
+            }
+            if (index_fd_ >= 0 && !index_buffer_.empty())
+            {
+                write_all(index_fd_, index_buffer_.data(), index_buffer_.size());
+            }
+
+            segment_offset_ += end - begin;
+            begin = end;
+        }
+
+        if (!sync(segment_fd_))
+        {
+            return false;
+        }
+        stats_.bytes.fetch_add(flushing_.size(), std::memory_order_relaxed);
+        return true;
+    }
+
+    // Makes the previous segment durable before any record lands in the new
+    // one, so a crash leaves at most the newest segment with a torn tail
+    bool open_next_segment()
+    {
+        if (segment_fd_ >= 0 && !sync(segment_fd_))
+        {
+            return false;
+        }
+        close_segment();
+
+        uint64_t index = next_segment_++;
+        std::string path = dir_ + "/" + segment_name(index);
+        segment_fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+        if (segment_fd_ < 0)
+        {
+            std::perror(("history log: " + path).c_str());
+            return false;
+        }
+        if (first_segment_.load(std::memory_order_relaxed) == 0)
+        {
+            first_segment_.store(index, std::memory_order_release);
+        }
+        segment_offset_ = 0;
+        index_fd_ = ::open(index_path(path).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+
+        sync_dir(); // persist the directory entry too
+        stats_.segments.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Deletes the segments older than the newest retain_segments_, then
+    // forgets the rooms that had records only in them. Flusher thread only.
+    void retire_segments()
+    {
+        uint64_t first = first_segment_.load(std::memory_order_relaxed);
+        uint64_t last = next_segment_ - 1;
+        if (retain_segments_ == 0 || first == 0 || last - first < retain_segments_)
+        {
+            return;
+        }
+        uint64_t keep = last - retain_segments_ + 1;
+        uint64_t kept_sequence = segment_first_sequence(keep);
+
+        // Reads stop at the new first segment before its elders go away; one
+        // already mapping them keeps its mapping
+        first_segment_.store(keep, std::memory_order_release);
+        for (uint64_t index = first; index < keep; ++index)
+        {
+            std::string path = segment_path(index);
+            std::remove(path.c_str());
+            std::remove(index_path(path).c_str());
+        }
+        if (kept_sequence != 0)
+        {
+            prune_rooms(kept_sequence);
+        }
+    }
+
+    // Drops the rooms whose last record is older than first_sequence and
+    // rewrites "rooms" to list just the others. Their first records may be
+    // gone too, so reads of them stop at first_sequence.
+    void prune_rooms(uint64_t first_sequence)
+    {
+        std::vector<char> entries;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            size_t before = rooms_.size();
+            for (auto room = rooms_.begin(); room != rooms_.end();)
+            {
+                if (room->second.last < first_sequence)
+                {
+                    room = rooms_.erase(room);
+                    continue;
+                }
+                room->second.first = std::max(room->second.first, first_sequence);
+                encode_room(room->first, room->second.first, entries);
+                ++room;
+            }
+            if (rooms_.size() == before)
+            {
+                return;
+            }
+            pending_rooms_.clear(); // listed in entries
+        }
+
+        std::string path = dir_ + "/rooms";
+        std::string temp = path + ".tmp";
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool written = fd >= 0 && write_all(fd, entries.data(), entries.size()) && sync(fd);
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        // The old file lists every kept room too, so keep appending to it
+        // if the new one cannot replace it
+        if (!written || std::rename(temp.c_str(), path.c_str()) != 0)
+        {
+            std::perror("history log: rewrite rooms");
+            std::remove(temp.c_str());
+            return;
+        }
+        sync_dir();
+        int rooms_fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+        if (rooms_fd >= 0)
+        {
+            ::close(rooms_fd_);
+            rooms_fd_ = rooms_fd;
+        }
+    }
+
+    void sync_dir() const
+    {
+        int dir_fd = ::open(dir_.c_str(), O_RDONLY);
+        if (dir_fd >= 0)
+        {
+            ::fsync(dir_fd);
+            ::close(dir_fd);
+        }
+    }
+
+    static bool write_all(int fd, const char *data, size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t written = ::write(fd, data, length);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                std::perror("history log: write");
+                return false;
+            }
+            data += written;
+            length -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    bool sync(int fd)
+    {
+#ifdef __linux__
+        int result = ::fdatasync(fd);
+#else
+        int result = ::fsync(fd);
+#endif
+        if (result != 0)
+        {
+            std::perror("history log: fsync");
+            return false;
+        }
+        stats_.fsyncs.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void close_segment()
+    {
+        if (segment_fd_ >= 0)
+        {
+            ::close(segment_fd_);
+            segment_fd_ = -1;
+        }
+        if (index_fd_ >= 0)
+        {
+            ::close(index_fd_);
+            index_fd_ = -1;
+        }
+    }
+
+    static std::string index_path(const std::string &segment_path)
+    {
+        return segment_path.substr(0, segment_path.size() - 4) + ".idx";
+    }
+
+    std::string segment_path(uint64_t index) const
+    {
+        return dir_ + "/" + segment_name(index);
+    }
+
+    // {u64 segment, u64 durable length, u64 last sequence, u32 room count},
+    // {u32 room id, u64 last sequence} per room, then the CRC of all of it;
+    // replaced atomically by rename. A room's last sequence may be one
+    // still in the group commit batch, which only makes a read look for it.
+    void write_checkpoint()
+    {
+        last_checkpoint_ = std::chrono::steady_clock::now();
+        if (segment_fd_ < 0)
+        {
+            return;
+        }
+        std::vector<char> &data = checkpoint_buffer_;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            data.resize(CHECKPOINT_HEADER_SIZE + rooms_.size() * CHECKPOINT_ROOM_SIZE + 4);
+            write_le(data.data() + 24, rooms_.size(), 4);
+            char *entry = data.data() + CHECKPOINT_HEADER_SIZE;
+            for (const auto &room : rooms_)
+            {
+                write_le(entry, room.first, 4);
+                write_le(entry + 4, room.second.last, 8);
+                entry += CHECKPOINT_ROOM_SIZE;
+            }
+        }
+        write_le(data.data(), next_segment_ - 1, 8);
+        write_le(data.data() + 8, segment_offset_, 8);
+        write_le(data.data() + 16, last_sequence_, 8);
+        write_le(data.data() + data.size() - 4, Crc32c::compute(data.data(), data.size() - 4), 4);
+
+        std::string path = dir_ + "/checkpoint";
+        std::string temp = path + ".tmp";
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            return;
+        }
+        bool written = write_all(fd, data.data(), data.size());
+        ::close(fd);
+        if (written)
+        {
+            std::rename(temp.c_str(), path.c_str());
+        }
+    }
+
+    struct Checkpoint
+    {
+        uint64_t segment = 0;
+        uint64_t length = 0;
+        uint64_t sequence = 0;
+        std::vector<std::pair<uint32_t, uint64_t>> rooms; // room id, last sequence
+    };
+
+    bool read_checkpoint(Checkpoint &checkpoint) const
+    {
+        std::string path = dir_ + "/checkpoint";
+        std::error_code error;
+        uint64_t size = std::filesystem::file_size(path, error);
+        if (error || size < CHECKPOINT_HEADER_SIZE + 4)
+        {
+            return false;
+        }
+        std::vector<char> data(static_cast<size_t>(size));
+        std::FILE *file = std::fopen(path.c_str(), "rb");
+        if (!file)
+        {
+            return false;
+        }
+        bool complete = std::fread(data.data(), 1, data.size(), file) == data.size();
+        std::fclose(file);
+        if (!complete ||
+            read_le(data.data() + data.size() - 4, 4) != Crc32c::compute(data.data(), data.size() - 4) ||
+            CHECKPOINT_HEADER_SIZE + read_le(data.data() + 24, 4) * CHECKPOINT_ROOM_SIZE + 4 != data.size())
+        {
+            return false;
+        }
+        checkpoint.segment = read_le(data.data(), 8);
+        checkpoint.length = read_le(data.data() + 8, 8);
+        checkpoint.sequence = read_le(data.data() + 16, 8);
+        for (size_t at = CHECKPOINT_HEADER_SIZE; at + 4 < data.size(); at += CHECKPOINT_ROOM_SIZE)
+        {
+            checkpoint.rooms.emplace_back(static_cast<uint32_t>(read_le(data.data() + at, 4)),
+                                          read_le(data.data() + at + 4, 8));
+        }
+        return true;
+    }
+
+    static void encode_room(uint32_t room_id, uint64_t sequence, std::vector<char> &out)
+    {
+        size_t at = out.size();
+        out.resize(at + ROOM_ENTRY_SIZE);
+        char *entry = out.data() + at;
+        write_le(entry, room_id, 4);
+        write_le(entry + 4, sequence, 8);
+        write_le(entry + 12, Crc32c::compute(entry, 12), 4);
+    }
+
+    // Loads "rooms", cutting off a torn last entry; false if it is missing
+    bool load_rooms()
+    {
+        std::string path = dir_ + "/rooms";
+        std::FILE *file = std::fopen(path.c_str(), "rb");
+        if (!file)
+        {
+            return false;
+        }
+        char entry[ROOM_ENTRY_SIZE];
+        uint64_t valid = 0;
+        while (std::fread(entry, 1, ROOM_ENTRY_SIZE, file) == ROOM_ENTRY_SIZE &&
+               read_le(entry + 12, 4) == Crc32c::compute(entry, 12))
+        {
+            uint64_t first = read_le(entry + 4, 8);
+            rooms_.emplace(static_cast<uint32_t>(read_le(entry, 4)), RoomRange{first, first});
+            valid += ROOM_ENTRY_SIZE;
+        }
+        std::fclose(file);
+        if (valid < std::filesystem::file_size(path) &&
+            ::truncate(path.c_str(), static_cast<off_t>(valid)) != 0)
+        {
+            std::perror("history log: truncate rooms");
+        }
+        return true;
+    }
+
+    // Opens "rooms" for appending, first adding the rooms recover() found
+    // that it did not list
+    bool open_rooms()
+    {
+        std::string path = dir_ + "/rooms";
+        bool created = !std::filesystem::exists(path);
+        rooms_fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (rooms_fd_ < 0)
+        {
+            return false;
+        }
+        if (!pending_rooms_.empty() &&
+            (!write_all(rooms_fd_, pending_rooms_.data(), pending_rooms_.size()) || !sync(rooms_fd_)))
+        {
+            return false;
+        }
+        pending_rooms_.clear();
+        if (created)
+        {
+            sync_dir();
+        }
+        return true;
+    }
+
+    // A read-only mapping of one segment
+    class MappedSegment
+    {
+    public:
+        explicit MappedSegment(const std::string &path)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+            {
+                return;
+            }
+            struct stat info;
+            if (::fstat(fd, &info) == 0 && info.st_size > 0)
+            {
+                void *data = ::mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ,
+                                    MAP_PRIVATE, fd, 0);
+                if (data != MAP_FAILED)
+                {
+                    data_ = static_cast<const char *>(data);
+                    size_ = static_cast<size_t>(info.st_size);
+                }
+            }
+            ::close(fd);
+        }
+
+        MappedSegment(const MappedSegment &) = delete;
+        MappedSegment &operator=(const MappedSegment &) = delete;
+
+        ~MappedSegment()
+        {
+            if (data_)
+            {
+                ::munmap(const_cast<char *>(data_), size_);
+            }
+        }
+
+        const char *data() const { return data_; }
+        size_t size() const { return size_; }
+
+        // Length of the valid record at offset, or 0 if it is torn or corrupt
+        size_t record_at(size_t offset) const
+        {
+            if (size_ - offset < RECORD_HEADER_SIZE)
+            {
+                return 0;
+            }
+            size_t payload = static_cast<size_t>(read_le(data_ + offset, 4));
+            if (payload < RECORD_FIXED_SIZE || size_ - offset - RECORD_HEADER_SIZE < payload)
+            {
+                return 0;
+            }
+            const char *body = data_ + offset + RECORD_HEADER_SIZE;
+            if (read_le(data_ + offset + 4, 4) != Crc32c::compute(body, payload))
+            {
+                return 0;
+            }
+            return RECORD_HEADER_SIZE + payload;
+        }
+
+    private:
+        const char *data_ = nullptr;
+        size_t size_ = 0;
+    };
+
+    static std::shared_ptr<Message> decode_record(const char *record)
+    {
+        size_t payload = static_cast<size_t>(read_le(record, 4));
+        EnvelopeView view(record + RECORD_HEADER_SIZE, payload);
+        size_t prefix = static_cast<size_t>(read_le(view.payload(), 2));
+        prefix = std::min(prefix, view.payload_length() - 2);
+
+        Envelope envelope;
+        envelope.sequence = view.sequence();
+        envelope.timestamp_ns = view.timestamp_ns();
+        envelope.sender_id = view.sender_id();
+        envelope.room_id = view.room_id();
+
+        auto msg = make_message();
+        msg->set_envelope(envelope);
+        msg->append_legacy_prefix(view.payload() + 2, prefix);
+        msg->assign_body(view.payload() + 2 + prefix, view.payload_length() - 2 - prefix);
+        return msg;
+    }
+
+    // Offset to start scanning segment from so that at least `needed`
+    // records older than `before` follow, according to its sparse index; 0
+    // without a usable one
+    static size_t scan_start(const std::string &path, const MappedSegment &segment,
+                             uint64_t before, size_t needed)
+    {
+        std::FILE *file = std::fopen(index_path(path).c_str(), "rb");
+        if (!file)
+        {
+            return 0;
+        }
+        std::vector<char> index;
+        char entry[INDEX_ENTRY_SIZE];
+        while (std::fread(entry, 1, INDEX_ENTRY_SIZE, file) == INDEX_ENTRY_SIZE)
+        {
+            index.insert(index.end(), entry, entry + INDEX_ENTRY_SIZE);
+        }
+        std::fclose(file);
+
+        // Entries past the durable end may outlive a crash; skip them along
+        // with those not older than `before`
+        size_t entries = index.size() / INDEX_ENTRY_SIZE;
+        while (entries > 0)
+        {
+            const char *newest = index.data() + (entries - 1) * INDEX_ENTRY_SIZE;
+            if (read_le(newest + 8, 8) < segment.size() && read_le(newest, 8) < before)
+            {
+                break;
+            }
+            --entries;
+        }
+        size_t back = (needed + INDEX_INTERVAL - 1) / INDEX_INTERVAL;
+        if (entries <= back)
+        {
+            return 0;
+        }
+        const char *chosen = index.data() + (entries - 1 - back) * INDEX_ENTRY_SIZE;
+        size_t offset = static_cast<size_t>(read_le(chosen + 8, 8));
+        if (segment.record_at(offset) == 0 ||
+            read_le(segment.data() + offset + RECORD_HEADER_SIZE, 8) != read_le(chosen, 8))
+        {
+            return 0;
+        }
+        return offset;
+    }
+
+    static constexpr uint64_t ALL_ROOMS = UINT64_MAX;
+
+    // Collects into found the newest `needed` records of room_id (all rooms
+    // if room_id is ALL_ROOMS) older than `before`. Scans from the index
+    // entry far enough back for `needed` records of any room, then, if that
+    // was not enough for this room, just the part before it.
+    static void scan_segment(const std::string &path, const MappedSegment &segment,
+                               uint64_t room_id, uint64_t before, size_t needed,
+                               std::deque<message_ptr> &found)
+    {
+        size_t start = scan_start(path, segment, before, needed);
+        std::deque<size_t> offsets;
+        scan_range(segment, start, segment.size(), room_id, before, needed, offsets);
+        if (offsets.size() < needed && start > 0)
+        {
+            std::deque<size_t> older;
+            scan_range(segment, 0, start, room_id, before, needed - offsets.size(), older);
+            offsets.insert(offsets.begin(), older.begin(), older.end());
+        }
+
+        found.clear();
+        for (size_t offset : offsets)
+        {
+            found.push_back(decode_record(segment.data() + offset));
+        }
+    }
+
+    // Keeps the offsets of the newest `needed` matching records in [from, to)
+    static void scan_range(const MappedSegment &segment, size_t from, size_t to,
+                             uint64_t room_id, uint64_t before, size_t needed,
+                             std::deque<size_t> &offsets)
+    {
+        for (size_t offset = from, length; offset < to && (length = segment.record_at(offset)) > 0;
+             offset += length)
+        {
+            EnvelopeView view(segment.data() + offset + RECORD_HEADER_SIZE,
+                              length - RECORD_HEADER_SIZE);
+            if (view.sequence() >= before)
+            {
+                return;
+            }
+            if (room_id != ALL_ROOMS && view.room_id() != room_id)
+            {
+                continue;
+            }
+            offsets.push_back(offset);
+            if (offsets.size() > needed)
+            {
+                offsets.pop_front();
+            }
+        }
+    }
+
+    // Scans dir for the oldest segment; recover() only, the flusher keeps
+    // first_segment_ up to date after that
+    uint64_t find_first_segment() const
+    {
+        uint64_t first = 0;
+        for (const auto &entry : std::filesystem::directory_iterator(dir_))
+        {
+            unsigned long long index;
+            std::string name = entry.path().filename().string();
+            if (std::sscanf(name.c_str(), "history-%10llu.log", &index) == 1 &&
+                name == segment_name(index) && (first == 0 || index < first))
+            {
+                first = index;
+            }
+        }
+        return first;
+    }
+
+    // Sequence of a segment's first record, from its index or the segment
+    // itself; 0 if it has none
+    uint64_t segment_first_sequence(uint64_t index) const
+    {
+        std::string path = segment_path(index);
+        char entry[INDEX_ENTRY_SIZE];
+        std::FILE *file = std::fopen(index_path(path).c_str(), "rb");
+        if (file)
+        {
+            bool complete = std::fread(entry, 1, INDEX_ENTRY_SIZE, file) == INDEX_ENTRY_SIZE;
+            std::fclose(file);
+            if (complete && read_le(entry + 8, 8) == 0)
+            {
+                return read_le(entry, 8);
+            }
+        }
+        MappedSegment segment(path);
+        if (!segment.data() || segment.record_at(0) == 0)
+        {
+            return 0;
+        }
+        return read_le(segment.data() + RECORD_HEADER_SIZE, 8);
+    }
+
+    // Finds where numbering continues and each room's first and last
+    // record. With the rooms file and a usable checkpoint that takes just a
+    // scan of what was written after the checkpoint; otherwise the whole log
+    // is scanned. Rooms the rooms file did not list are queued for it. A
+    // torn tail on the newest segment, left by a crash mid-write, is
+    // truncated away.
+    void recover(bool rooms_loaded)
+    {
+        uint64_t first = find_first_segment();
+        first_segment_.store(first, std::memory_order_relaxed);
+        uint64_t last = next_segment_ - 1;
+        if (first == 0)
+        {
+            return;
+        }
+
+        uint64_t from = first;
+        uint64_t offset = 0;
+        Checkpoint checkpoint;
+        if (rooms_loaded && read_checkpoint(checkpoint) &&
+            checkpoint.segment >= first && checkpoint.segment <= last)
+        {
+            from = checkpoint.segment;
+            offset = checkpoint.length;
+            recovered_sequence_ = checkpoint.sequence;
+            for (const auto &entry : checkpoint.rooms)
+            {
+                auto room = rooms_.find(entry.first);
+                if (room != rooms_.end())
+                {
+                    room->second.last = std::max(room->second.last, entry.second);
+                }
+            }
+        }
+        else
+        {
+            std::cerr << "history log: scanning all of " << dir_ << std::endl;
+        }
+
+        for (uint64_t index = from; index <= last; ++index, offset = 0)
+        {
+            std::string path = segment_path(index);
+            MappedSegment segment(path);
+            if (!segment.data())
+            {
+                continue;
+            }
+            size_t at = static_cast<size_t>(std::min<uint64_t>(offset, segment.size()));
+            for (size_t length; (length = segment.record_at(at)) > 0; at += length)
+            {
+                EnvelopeView view(segment.data() + at + RECORD_HEADER_SIZE,
+                                  length - RECORD_HEADER_SIZE);
+                auto room = rooms_.try_emplace(view.room_id(), RoomRange{view.sequence(), 0});
+                if (room.second)
+                {
+                    encode_room(view.room_id(), view.sequence(), pending_rooms_);
+                }
+                room.first->second.last = std::max(room.first->second.last, view.sequence());
+                recovered_sequence_ = std::max(recovered_sequence_, view.sequence());
+            }
+
+            if (index == last && at < segment.size())
+            {
+                std::cerr << "history log: truncating torn tail of " << path
+                          << " at " << at << std::endl;
+                if (::truncate(path.c_str(), static_cast<off_t>(at)) != 0)
+                {
+                    std::perror("history log: truncate");
+                }
+            }
+        }
+    }
+
+    void run_reader()
+    {
+        for (;;)
+        {
+            ReadRequest request;
+            {
+                std::unique_lock<std::mutex> lock(reader_mutex_);
+                reader_work_.wait(lock, [this]()
+                                  { return reader_stopping_ || !reads_.empty(); });
+                if (reader_stopping_)
+                {
+                    return;
+                }
+                request = std::move(reads_.front());
+                reads_.pop_front();
+            }
+            if (request.before > 0 && !wait_durable(request.before - 1))
+            {
+                return;
+            }
+            request.done(read(request.room_id, request.before, request.count));
+        }
+    }
+
+    // Waits until every record up to sequence stamped so far is on disk;
+    // false if the log is shutting down
+    bool wait_durable(uint64_t sequence)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        uint64_t target = std::min(sequence, pending_sequence_);
+        durable_.wait(lock, [&]()
+                      { return stats_.durable_sequence.load(std::memory_order_acquire) >= target ||
+                               failed_ || reader_stopping_; });
+        return !reader_stopping_;
+    }
+
+    // Finds the newest segment starting before `before`, or after the room's
+    // last record, by binary search on the segments' first sequences and
+    // walks back from there, scanning
+    // each from the index entry just far enough back. Stops at the room's
+    // first record, or after max_read_segments_ segments.
+    HistoryRead read(uint32_t room_id, uint64_t before, size_t count)
+    {
+        HistoryRead result;
+        uint64_t room_first;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto room = rooms_.find(room_id);
+            if (room == rooms_.end())
+            {
+                return result;
+            }
+            room_first = room->second.first;
+            before = std::min(before, room->second.last + 1);
+        }
+        uint64_t first = first_segment_.load(std::memory_order_acquire);
+        uint64_t last = next_segment_.load(std::memory_order_acquire) - 1;
+        if (first == 0 || count == 0 || before <= room_first)
+        {
+            return result;
+        }
+
+        uint64_t low = first, high = last, found = 0;
+        while (low <= high)
+        {
+            uint64_t middle = low + (high - low) / 2;
+            uint64_t sequence = segment_first_sequence(middle);
+            if (sequence != 0 && sequence < before)
+            {
+                found = middle;
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle - 1;
+            }
+        }
+
+        std::deque<message_ptr> page;
+        uint64_t scanned_first = 0; // first sequence of the oldest segment scanned
+        size_t scanned = 0;
+        for (uint64_t index = found; index >= first && index > 0 && page.size() < count; --index)
+        {
+            if (scanned == max_read_segments_)
+            {
+                result.more_before = scanned_first; // continue with the older segments
+                break;
+            }
+            ++scanned;
+            std::string path = segment_path(index);
+            MappedSegment segment(path);
+            if (!segment.data())
+            {
+                continue;
+            }
+            std::deque<message_ptr> older;
+            scan_segment(path, segment, room_id, before, count - page.size(), older);
+            if (!older.empty())
+            {
+                before = older.front()->sequence;
+            }
+            page.insert(page.begin(), older.begin(), older.end());
+
+            scanned_first = segment_first_sequence(index);
+            if (scanned_first != 0 && scanned_first <= room_first)
+            {
+                break; // the room starts in this segment
+            }
+        }
+
+        if (page.size() == count && page.front()->sequence > room_first)
+        {
+            result.more_before = page.front()->sequence;
+        }
+        result.messages.assign(page.begin(), page.end());
+        return result;
+    }
+};
+
+#else
+
+// The history log is built on POSIX file I/O (mmap, fdatasync). Windows
+// builds reject --history-dir, so this is never constructed; it only keeps
+// the callers compiling.
+class HistoryLog
+{
+public:
+    using ReadCallback = std::function<void(HistoryRead)>;
+
+    HistoryLog(const std::string &, uint64_t, std::chrono::milliseconds, size_t, size_t,
+               HistoryLogStats &)
+    {
+        throw std::runtime_error("the history log is not supported on Windows");
+    }
+
+    uint64_t recovered_sequence() const { return 0; }
+    bool has_history(uint32_t) { return false; }
+    void read_before(uint32_t, uint64_t, size_t, ReadCallback) {}
+    void append(const std::vector<std::shared_ptr<Message>> &, std::atomic<uint64_t> &) {}
+};
+
+#endif
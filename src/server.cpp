@@ -1,177 +1,2892 @@
 #include "common.cpp"
-#include <set>
+#include "history_log.cpp"
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <stdexcept>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+#ifdef SO_REUSEPORT
+// Lets several acceptors bind the same port; the kernel spreads connections
+using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+// What a session does when a delivery finds its send queue at its caps
+enum class SlowConsumerPolicy
+{
+    drop_oldest, // discard queued messages from the front until under the caps
+    drop_newest, // discard the incoming message
+    disconnect,  // close the connection
+    coalesce,    // replace the whole backlog with one replay of the room history
+    spill        // append further messages to a per-session file, sent once RAM drains
+};
+
+// Runtime tunables, filled from the command line in main()
+struct ServerConfig
+{
+    unsigned short port = DEFAULT_PORT;
+    size_t write_batch_max_msgs = 64;        // iovecs per gather write
+    size_t write_batch_max_bytes = 64 * 1024; // bytes per gather write
+    unsigned stats_interval_sec = 0;         // 0 disables periodic stats
+    size_t threads = 0;                      // 0 means hardware_concurrency()
+    bool per_core = false;                   // one io_context + acceptor per thread
+    size_t core_ring_size = 4096;            // per-core-pair SPSC ring slots
+    size_t room_log_size = 0;                // shared room log slots, 0 = per-session queues
+    size_t room_shards = 64;                 // room registry lock shards
+    size_t fan_out_chunk = 4096;             // participants per parallel fan-out chunk, 0 = off
+    unsigned batch_window_us = 200;          // longest a room holds messages back, 0 = off
+    size_t batch_max_msgs = 64;              // a room batch is sent once this many are waiting
+    size_t join_history = 20;                // history messages sent on join
+    size_t history_page_max = 500;           // largest history page served per request
+    unsigned hello_timeout_ms = 500;         // silent peers are legacy after this
+    size_t max_body_size = Message::DEFAULT_MAX_BODY_SIZE; // inbound body limit
+    size_t send_queue_max_msgs = 4096;       // per-session queued messages
+    size_t send_queue_max_bytes = 16 * 1024 * 1024; // per-session queued bytes
+    SlowConsumerPolicy slow_consumer_policy = SlowConsumerPolicy::disconnect;
+    std::string spill_dir;                   // empty uses std::tmpfile()
+    uint64_t spill_max_bytes = 1ull << 30;   // per-session spill file limit
+    std::string history_dir;                 // empty disables the history log
+    uint64_t history_segment_bytes = 64 * 1024 * 1024; // history log segment size
+    unsigned history_flush_ms = 2;           // group commit window
+    size_t history_read_segments = 4;        // most history log segments one page read scans
+    size_t history_retain_segments = 0;      // newest history log segments kept, 0 = all
+};
+
+// Server-wide counters, updated from any io thread
+struct ServerMetrics
+{
+    std::atomic<uint64_t> write_batches{0};
+    std::atomic<uint64_t> write_batch_msgs{0};
+    std::atomic<uint64_t> core_ring_overflows{0};
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> frames_read{0};
+    std::atomic<uint64_t> slow_consumer_events{0};
+    std::atomic<uint64_t> slow_consumer_drops{0};
+    std::atomic<uint64_t> spill_files{0};
+    std::atomic<uint64_t> spilled_bytes{0};
+    std::atomic<uint64_t> slow_consumer_disconnects{0};
+    std::atomic<uint64_t> send_queue_hwm_msgs{0};
+    std::atomic<uint64_t> send_queue_hwm_bytes{0};
+    std::atomic<uint64_t> room_batches{0};
+    std::atomic<uint64_t> room_batch_msgs{0};
+    HistoryLogStats history;
+
+    static void raise_to(std::atomic<uint64_t> &mark, uint64_t value)
+    {
+        uint64_t current = mark.load(std::memory_order_relaxed);
+        while (value > current &&
+               !mark.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    void record_send_queue(size_t msgs, size_t bytes)
+    {
+        raise_to(send_queue_hwm_msgs, msgs);
+        raise_to(send_queue_hwm_bytes, bytes);
+    }
+
+    void record_write_batch(size_t msgs)
+    {
+        write_batches.fetch_add(1, std::memory_order_relaxed);
+        write_batch_msgs.fetch_add(msgs, std::memory_order_relaxed);
+    }
+
+    void record_room_batch(size_t msgs)
+    {
+        room_batches.fetch_add(1, std::memory_order_relaxed);
+        room_batch_msgs.fetch_add(msgs, std::memory_order_relaxed);
+    }
+
+    void record_read(size_t frames)
+    {
+        reads.fetch_add(1, std::memory_order_relaxed);
+        frames_read.fetch_add(frames, std::memory_order_relaxed);
+    }
+
+    void report(std::ostream &os) const
+    {
+        uint64_t batches = write_batches.load(std::memory_order_relaxed);
+        uint64_t msgs = write_batch_msgs.load(std::memory_order_relaxed);
+        double avg_batch = batches ? static_cast<double>(msgs) / batches : 0.0;
+        uint64_t read_calls = reads.load(std::memory_order_relaxed);
+        uint64_t frames = frames_read.load(std::memory_order_relaxed);
+        double avg_frames = read_calls ? static_cast<double>(frames) / read_calls : 0.0;
+        uint64_t room_drains = room_batches.load(std::memory_order_relaxed);
+        double avg_room_batch = room_drains
+                                    ? static_cast<double>(room_batch_msgs.load(std::memory_order_relaxed)) / room_drains
+                                    : 0.0;
+
+        os << "[stats] writes=" << batches
+           << " msgs=" << msgs
+           << " avg_batch=" << avg_batch
+           << " reads=" << read_calls
+           << " frames_per_read=" << avg_frames
+           << " room_batch=" << avg_room_batch
+           << " ring_overflows=" << core_ring_overflows.load(std::memory_order_relaxed)
+           << " slow_consumers=" << slow_consumer_events.load(std::memory_order_relaxed)
+           << " dropped=" << slow_consumer_drops.load(std::memory_order_relaxed)
+           << " slow_disconnects=" << slow_consumer_disconnects.load(std::memory_order_relaxed)
+           << " queue_hwm_msgs=" << send_queue_hwm_msgs.load(std::memory_order_relaxed)
+           << " queue_hwm_bytes=" << send_queue_hwm_bytes.load(std::memory_order_relaxed)
+           << " spill_files=" << spill_files.load(std::memory_order_relaxed)
+           << " spilled_bytes=" << spilled_bytes.load(std::memory_order_relaxed)
+           << " log_records=" << history.records.load(std::memory_order_relaxed)
+           << " log_fsyncs=" << history.fsyncs.load(std::memory_order_relaxed)
+           << " log_durable_seq=" << history.durable_sequence.load(std::memory_order_relaxed)
+           << std::endl;
+    }
+};
+
+// Caches the "[Thu Oct 15 23:18:57 2026] " text legacy peers see in front of
+// every message, reformatting it at most once per second per io thread. The
+// cache is thread-local, so reading it needs no synchronization.
+class TimestampCache
+{
+public:
+    static constexpr size_t MAX_PREFIX_SIZE = 64;
+
+    struct Prefix
+    {
+        std::time_t second = -1;
+        char text[MAX_PREFIX_SIZE];
+        size_t length = 0;
+    };
+
+    static const Prefix &current(std::time_t now)
+    {
+        thread_local Prefix prefix;
+        if (now != prefix.second)
+        {
+            prefix.length = format_timestamp(now, prefix.text, MAX_PREFIX_SIZE);
+            prefix.second = now;
+        }
+        return prefix;
+    }
+};
+
+// Lock-free ring with exactly one producer thread and one consumer thread
+template <typename T>
+class SpscRing
+{
+private:
+    std::vector<T> slots_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> head_{0}; // next slot to pop, owned by consumer
+    alignas(64) std::atomic<size_t> tail_{0}; // next slot to push, owned by producer
+
+public:
+    explicit SpscRing(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+        slots_.resize(size);
+        mask_ = size - 1;
+    }
+
+    bool try_push(const T &value)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == slots_.size())
+        {
+            return false;
+        }
+        slots_[tail & mask_] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T &value)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        value = std::move(slots_[head & mask_]);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+};
+
+// Per-core mode message fabric: one SPSC ring for every (source, target)
+// core pair. A core only ever publishes from its own thread and only drains
+// its inbound rings on its own thread, so no locks are shared between cores.
+class CoreBus
+{
+public:
+    using Sink = std::function<void(const message_ptr &)>;
+
+private:
+    static constexpr size_t MAX_DRAIN_PER_RING = 256;
+
+    struct Core
+    {
+        boost::asio::io_context *io_context = nullptr;
+        Sink sink;
+        std::atomic<bool> drain_scheduled{false};
+        std::vector<std::unique_ptr<SpscRing<message_ptr>>> inbound; // by source core
+        std::vector<std::deque<message_ptr>> overflow;               // by target core
+        bool flush_scheduled = false;
+    };
+
+    std::vector<std::unique_ptr<Core>> cores_;
+    ServerMetrics &metrics_;
+
+public:
+    CoreBus(size_t core_count, size_t ring_size, ServerMetrics &metrics)
+        : metrics_(metrics)
+    {
+        for (size_t i = 0; i < core_count; ++i)
+        {
+            auto core = std::make_unique<Core>();
+            for (size_t j = 0; j < core_count; ++j)
+            {
+                core->inbound.push_back(std::make_unique<SpscRing<message_ptr>>(ring_size));
+            }
+            core->overflow.resize(core_count);
+            cores_.push_back(std::move(core));
+        }
+    }
+
+    // Must be called for every core before any io_context runs
+    void attach(size_t core, boost::asio::io_context &io_context, Sink sink)
+    {
+        cores_[core]->io_context = &io_context;
+        cores_[core]->sink = std::move(sink);
+    }
+
+    // Only called on core `from`'s thread
+    void publish(size_t from, const message_ptr &msg)
+    {
+        Core &source = *cores_[from];
+        for (size_t to = 0; to < cores_.size(); ++to)
+        {
+            if (to == from)
+            {
+                continue;
+            }
+
+            // Keep per-pair FIFO order: once anything overflowed, queue behind it
+            if (!source.overflow[to].empty() || !cores_[to]->inbound[from]->try_push(msg))
+            {
+                source.overflow[to].push_back(msg);
+                metrics_.core_ring_overflows.fetch_add(1, std::memory_order_relaxed);
+                schedule_flush(from);
+                continue;
+            }
+            schedule_drain(to);
+        }
+    }
+
+private:
+    void schedule_drain(size_t core)
+    {
+        Core &target = *cores_[core];
+        if (!target.drain_scheduled.exchange(true))
+        {
+            boost::asio::post(*target.io_context, [this, core]()
+                              { drain(core); });
+        }
+    }
+
+    void drain(size_t core)
+    {
+        Core &target = *cores_[core];
+        target.drain_scheduled.exchange(false);
+
+        bool more = false;
+        message_ptr msg;
+        for (auto &ring : target.inbound)
+        {
+            size_t drained = 0;
+            while (drained < MAX_DRAIN_PER_RING && ring->try_pop(msg))
+            {
+                target.sink(msg);
+                ++drained;
+            }
+            more = more || !ring->empty();
+        }
+        msg.reset();
+
+        // Yield to local handlers between batches
+        if (more)
+        {
+            schedule_drain(core);
+        }
+    }
+
+    void schedule_flush(size_t core)
+    {
+        Core &source = *cores_[core];
+        if (!source.flush_scheduled)
+        {
+            source.flush_scheduled = true;
+            boost::asio::post(*source.io_context, [this, core]()
+                              { flush_overflow(core); });
+        }
+    }
+
+    // Retries overflowed messages on the producer's own thread
+    void flush_overflow(size_t from)
+    {
+        Core &source = *cores_[from];
+        source.flush_scheduled = false;
+
+        bool pending = false;
+        for (size_t to = 0; to < cores_.size(); ++to)
+        {
+            auto &queue = source.overflow[to];
+            bool pushed = false;
+            while (!queue.empty() && cores_[to]->inbound[from]->try_push(queue.front()))
+            {
+                queue.pop_front();
+                pushed = true;
+            }
+            if (pushed)
+            {
+                schedule_drain(to);
+            }
+            pending = pending || !queue.empty();
+        }
+
+        if (pending)
+        {
+            schedule_flush(from);
+        }
+    }
+};
+
+// Room history already framed for one wire format, written to a joining
+// session as-is. owners keep the referenced bytes alive.
+struct ReplaySnapshot
+{
+    std::vector<boost::asio::const_buffer> buffers;
+    std::vector<std::shared_ptr<const void>> owners;
+    size_t bytes = 0;
+    size_t messages = 0;
+};
+
+using replay_ptr = std::shared_ptr<const ReplaySnapshot>;
+
+// A session write queue entry: a live message, framed for the session's
+// format at write time, or a history replay that is already framed
+struct OutboundItem
+{
+    message_ptr msg;
+    replay_ptr replay;
+
+    size_t size() const { return msg ? msg->length() : replay->bytes; }
+    size_t count() const { return msg ? 1 : replay->messages; }
+
+    void append_buffers(WireFormat format, std::vector<boost::asio::const_buffer> &buffers) const
+    {
+        if (msg)
+        {
+            msg->append_buffers(format, buffers);
+        }
+        else
+        {
+            buffers.insert(buffers.end(), replay->buffers.begin(), replay->buffers.end());
+        }
+    }
+};
+
+// Messages a room fans out together, shared by all of its recipients. A
+// batch of several is also framed once per wire format, so a session can
+// queue and write it as one multi-message item.
+// One is made per room drain, so it and its message list come from
+// BufferPool like messages do (see make_message_batch())
+struct MessageBatch
+{
+    std::vector<message_ptr, PoolAllocator<message_ptr>> messages;
+    replay_ptr legacy;
+    replay_ptr binary;
+
+    const replay_ptr &framed(WireFormat format) const
+    {
+        return format == WireFormat::legacy ? legacy : binary;
+    }
+};
+
+using message_batch = std::shared_ptr<const MessageBatch>;
+
+inline std::shared_ptr<MessageBatch> make_message_batch()
+{
+    return std::allocate_shared<MessageBatch>(PoolAllocator<MessageBatch>());
+}
 
 class ChatParticipant
 {
 public:
     virtual ~ChatParticipant() = default;
-    virtual void deliver(const Message &msg) = 0;
+    virtual WireFormat format() const = 0;
+    virtual void deliver(const message_batch &batch) = 0;
+    virtual void deliver_replay(const replay_ptr &replay) = 0;
+
+    // Shared-log rooms: new messages were appended to room_id's log past this
+    // participant's cursor. Only sent to participants that had caught up and
+    // went idle.
+    virtual void notify_log(uint32_t room_id) = 0;
 };
 
 using chat_participant_ptr = std::shared_ptr<ChatParticipant>;
 
-class ChatRoom
+// Dense storage with stable generational handles. Values live contiguously
+// in insertion order until an erase swaps the last value into the hole, so
+// both insert and erase are O(1) and iteration walks a flat array. A stale
+// handle (erased, or its slot reused) is detected by its generation.
+template <typename T>
+class SlotMap
 {
+public:
+    struct Handle
+    {
+        uint32_t index = UINT32_MAX;
+        uint32_t generation = 0;
+    };
+
 private:
-    std::set<chat_participant_ptr> participants_;
-    std::queue<Message> recent_messages_;
-    std::mutex mutex_;
-    static constexpr size_t MAX_RECENT_MSGS = 100;
+    struct Slot
+    {
+        uint32_t dense = 0;
+        uint32_t generation = 0;
+    };
+
+    std::vector<T> values_;
+    std::vector<uint32_t> value_slots_; // dense index -> slot index
+    std::vector<Slot> slots_;
+    std::vector<uint32_t> free_slots_;
+
+public:
+    Handle insert(T value)
+    {
+        uint32_t index;
+        if (!free_slots_.empty())
+        {
+            index = free_slots_.back();
+            free_slots_.pop_back();
+        }
+        else
+        {
+            index = static_cast<uint32_t>(slots_.size());
+            slots_.push_back(Slot{});
+        }
+
+        slots_[index].dense = static_cast<uint32_t>(values_.size());
+        values_.push_back(std::move(value));
+        value_slots_.push_back(index);
+        return Handle{index, slots_[index].generation};
+    }
+
+    bool erase(Handle handle)
+    {
+        if (handle.index >= slots_.size() ||
+            slots_[handle.index].generation != handle.generation)
+        {
+            return false;
+        }
+
+        uint32_t dense = slots_[handle.index].dense;
+        uint32_t last = static_cast<uint32_t>(values_.size() - 1);
+        if (dense != last)
+        {
+            values_[dense] = std::move(values_[last]);
+            value_slots_[dense] = value_slots_[last];
+            slots_[value_slots_[dense]].dense = dense;
+        }
+        values_.pop_back();
+        value_slots_.pop_back();
+
+        ++slots_[handle.index].generation;
+        free_slots_.push_back(handle.index);
+        return true;
+    }
+
+    // Position of handle's value in values(), or SIZE_MAX if it is stale
+    size_t position(Handle handle) const
+    {
+        if (handle.index >= slots_.size() ||
+            slots_[handle.index].generation != handle.generation)
+        {
+            return SIZE_MAX;
+        }
+        return slots_[handle.index].dense;
+    }
+
+    const std::vector<T> &values() const { return values_; }
+    size_t size() const { return values_.size(); }
+};
+
+// Ring that keeps the newest `capacity` values; pushing into a full ring
+// overwrites the oldest. The slots are allocated on the first push, so an
+// idle room costs no more than its bookkeeping.
+template <typename T>
+class RingBuffer
+{
+private:
+    std::vector<T> slots_;
+    size_t capacity_;
+    size_t next_ = 0; // slot the next push writes
+    size_t size_ = 0;
+
+public:
+    explicit RingBuffer(size_t capacity) : capacity_(capacity) {}
+
+    void push(T value)
+    {
+        if (slots_.empty())
+        {
+            slots_.resize(capacity_);
+        }
+        slots_[next_] = std::move(value);
+        next_ = (next_ + 1) % slots_.size();
+        size_ = std::min(size_ + 1, slots_.size());
+    }
+
+    // Oldest first
+    const T &operator[](size_t index) const
+    {
+        return slots_[(next_ + slots_.size() - size_ + index) % slots_.size()];
+    }
+
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+
+    // Appends the contents, oldest first
+    void copy_to(std::vector<T> &out) const
+    {
+        for (size_t i = 0; i < size_; ++i)
+        {
+            out.push_back((*this)[i]);
+        }
+    }
+};
+
+// Pre-framed copy of a room's history in one wire format, updated on every
+// deliver. Small frames are copied into fixed-size append-only chunks whose
+// bytes never move, so a snapshot can keep referencing them while later
+// frames are appended behind it. Large frames are referenced from their
+// Message instead of being copied.
+class ReplayLog
+{
+private:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+    static constexpr size_t MAX_COPIED_FRAME = 4 * 1024;
+
+    struct Chunk
+    {
+        std::unique_ptr<char[]> data{new char[CHUNK_SIZE]};
+        size_t size = 0;
+    };
+
+    struct Entry
+    {
+        std::shared_ptr<const void> owner;
+        boost::asio::const_buffer parts[2];
+        size_t part_count = 0;
+        uint64_t sequence = 0;
+    };
+
+    WireFormat format_;
+    RingBuffer<Entry> entries_;
+    std::shared_ptr<Chunk> chunk_; // null until the first copied frame
+    std::vector<boost::asio::const_buffer> frame_; // scratch
 
 public:
-    void join(chat_participant_ptr participant)
+    ReplayLog(WireFormat format, size_t capacity)
+        : format_(format), entries_(capacity) {}
+
+    void append(const message_ptr &msg)
+    {
+        frame_.clear();
+        msg->append_buffers(format_, frame_);
+        size_t frame_size = boost::asio::buffer_size(frame_);
+
+        Entry entry;
+        if (frame_size > MAX_COPIED_FRAME)
+        {
+            entry.owner = msg;
+            for (const auto &part : frame_)
+            {
+                entry.parts[entry.part_count++] = part;
+            }
+        }
+        else
+        {
+            if (!chunk_ || CHUNK_SIZE - chunk_->size < frame_size)
+            {
+                chunk_ = std::make_shared<Chunk>();
+            }
+            char *start = chunk_->data.get() + chunk_->size;
+            boost::asio::buffer_copy(boost::asio::buffer(start, frame_size), frame_);
+            chunk_->size += frame_size;
+
+            entry.owner = chunk_;
+            entry.parts[entry.part_count++] = boost::asio::buffer(start, frame_size);
+        }
+        entry.sequence = msg->sequence;
+        entries_.push(std::move(entry));
+    }
+
+    // The newest `limit` frames; adjacent frames in the same chunk coalesce
+    // into one buffer. sequences, if given, gets the sequence of each frame.
+    replay_ptr snapshot(size_t limit = SIZE_MAX, std::vector<uint64_t> *sequences = nullptr) const
+    {
+        if (entries_.size() == 0 || limit == 0)
+        {
+            return nullptr;
+        }
+
+        auto replay = std::make_shared<ReplaySnapshot>();
+        for (size_t i = entries_.size() - std::min(limit, entries_.size()); i < entries_.size(); ++i)
+        {
+            const Entry &entry = entries_[i];
+            if (replay->owners.empty() || replay->owners.back() != entry.owner)
+            {
+                replay->owners.push_back(entry.owner);
+            }
+
+            for (size_t p = 0; p < entry.part_count; ++p)
+            {
+                const auto &part = entry.parts[p];
+                auto &buffers = replay->buffers;
+                if (!buffers.empty() &&
+                    static_cast<const char *>(buffers.back().data()) + buffers.back().size() == part.data())
+                {
+                    buffers.back() = boost::asio::buffer(buffers.back().data(),
+                                                         buffers.back().size() + part.size());
+                }
+                else
+                {
+                    buffers.push_back(part);
+                }
+                replay->bytes += part.size();
+            }
+            if (sequences)
+            {
+                sequences->push_back(entry.sequence);
+            }
+            ++replay->messages;
+        }
+        return replay;
+    }
+};
+
+using participant_list = std::vector<chat_participant_ptr>;
+using participant_handle = SlotMap<chat_participant_ptr>::Handle;
+
+// A room's participants as published to broadcasts: the dense array cut
+// into immutable chunks of CHUNK_SIZE. Consecutive snapshots share every
+// chunk that no join or leave touched.
+struct ParticipantSnapshot
+{
+    static constexpr size_t CHUNK_SIZE = 256;
+
+    std::vector<std::shared_ptr<const participant_list>> chunks;
+    size_t size = 0;
+
+    // Chunks of CHUNK_SIZE (the last may be shorter) taken from list
+    static std::shared_ptr<const ParticipantSnapshot> from(participant_list list)
     {
-        std::vector<Message> recent;
+        auto snapshot = std::make_shared<ParticipantSnapshot>();
+        snapshot->size = list.size();
+        for (size_t first = 0; first < list.size(); first += CHUNK_SIZE)
+        {
+            auto begin = std::make_move_iterator(list.begin() + static_cast<std::ptrdiff_t>(first));
+            auto end = std::make_move_iterator(
+                list.begin() + static_cast<std::ptrdiff_t>(std::min(first + CHUNK_SIZE, list.size())));
+            snapshot->chunks.push_back(std::make_shared<const participant_list>(begin, end));
+        }
+        return snapshot;
+    }
+};
+
+using participant_snapshot = std::shared_ptr<const ParticipantSnapshot>;
+
+// Rooms are shared: the registry holds them while they have members, and
+// every handler a room posts holds it too, so a dropped room finishes the
+// work it has queued before it is freed.
+class ChatRoom : public std::enable_shared_from_this<ChatRoom>
+{
+private:
+    // join/leave are O(1) updates of the slot map and only mark the chunk
+    // of the published snapshot they touched stale. The next broadcast
+    // rebuilds the snapshot under mutex_, copying just the stale chunks and
+    // sharing the rest, then iterates it without holding a lock. Churn in a
+    // large room costs a broadcast one chunk copy per touched chunk plus a
+    // pointer per chunk, not a refcount per member. A replaced snapshot is
+    // freed when the last broadcast using it drops it.
+    SlotMap<chat_participant_ptr> participants_;
+    participant_snapshot snapshot_ = std::make_shared<const ParticipantSnapshot>();
+    std::vector<bool> stale_chunks_;
+    bool snapshot_stale_ = false;
+
+    RingBuffer<message_ptr> recent_messages_{MAX_RECENT_MSGS};
+    uint64_t evicted_sequence_ = 0; // newest message no longer in recent_messages_
+    ReplayLog legacy_replay_{WireFormat::legacy, MAX_RECENT_MSGS};
+    ReplayLog binary_replay_{WireFormat::binary, MAX_RECENT_MSGS};
+    std::mutex mutex_;
+
+    // In per-core mode each core has its own room; this forwards locally
+    // delivered messages to the other cores' rooms
+    CoreBus::Sink publish_;
+
+    // Per-core copies of one room share the id and name. All rooms share
+    // one sequence counter, so the history log stays in sequence order.
+    uint32_t id_;
+    std::string name_;
+    std::string label_; // "#name " in front of legacy text, empty for the lobby
+    std::shared_ptr<std::atomic<uint64_t>> sequence_;
+
+    // The room is an actor: senders push onto inbox_, a lock-free stack, and
+    // the room's strand swaps the whole stack out and handles it as one
+    // batch. Only that strand stamps, logs and fans out the room's messages,
+    // so senders never wait on each other, and mutex_ only orders a batch
+    // against joins and history or log reads. The inbox holds at most what
+    // the room's sessions have read since the last drain.
+    //
+    // Because one strand records a batch and finishes its fan-out before
+    // the next, every participant receives the room's messages in the order
+    // they were recorded, whatever the number of io threads. In per-core
+    // mode that holds per core: messages from other cores are recorded on
+    // this strand when they arrive.
+    struct InboxNode
+    {
+        std::shared_ptr<Message> msg;
+        InboxNode *next;
+    };
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    std::atomic<InboxNode *> inbox_{nullptr};
+    std::atomic<bool> drain_scheduled_{false};
+    std::vector<std::shared_ptr<Message>> batch_; // strand only
+
+    // Adaptive batching window. A wake-up within window_ of the last drain
+    // waits for the rest of the window, so messages arriving under load are
+    // fanned out together; batch_max_msgs_ waiting messages end the wait
+    // early. The window doubles while drains find several messages and
+    // halves, down to 0, while they find one, so light traffic is delivered
+    // right away and the added latency never exceeds batch_window_max_.
+    std::chrono::microseconds batch_window_max_{0};
+    std::chrono::microseconds window_{0};
+    size_t batch_max_msgs_ = SIZE_MAX;
+    std::atomic<size_t> inbox_size_{0};
+    boost::asio::steady_timer batch_timer_;
+    bool batch_timer_armed_ = false; // strand only
+    std::chrono::steady_clock::time_point last_drain_;
+    ServerMetrics *metrics_ = nullptr;
+
+    // A fan-out to a large room is cut into chunks of fan_out_chunk_
+    // participants. The strand and up to fan_out_helpers_ other io threads
+    // claim chunks from the shared next counter, so a thread that finishes
+    // early takes the next chunk instead of idling behind a slow one. Until
+    // the thread that finishes the last chunk posts end_fan_out() back, the
+    // strand starts no other fan-out: drains wait and local messages are
+    // held in fan_out_backlog_, which keeps each participant's batches in
+    // order without blocking the strand's thread.
+    struct ParallelFanOut
+    {
+        participant_snapshot participants;
+        message_batch messages;
+        size_t chunk = 0;
+        size_t chunks = 0;
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+    };
+    size_t fan_out_chunk_ = 0;
+    size_t fan_out_helpers_ = 0;
+    bool fan_out_running_ = false;                // strand only
+    std::deque<message_ptr> fan_out_backlog_;     // strand only
+
+    // Shared-log mode: a message is stored once in log_ at position
+    // log_head_ and each session pulls from its own cursor, so a broadcast
+    // does no per-recipient work beyond waking the sessions in log_waiters_,
+    // the ones that had caught up. log_slots_ == 0 means per-session
+    // queues; log_ is allocated with the first message.
+    size_t log_slots_ = 0;
+    std::vector<message_ptr> log_;
+    uint64_t log_head_ = 0;
+    participant_list log_waiters_;
+
+    // Optional on-disk history, shared by the per-core copies of the room.
+    // Only the room that stamps a message appends it.
+    HistoryLog *history_log_ = nullptr;
+
+    // A room with history in the log starts by reading its newest messages
+    // back. Until they are in, joiners get their history page later and
+    // nothing is fanned out, so no one sees a live message ahead of older
+    // history: drains wait and messages from other cores are held in
+    // seed_backlog_. seeding_ only changes on the strand, under mutex_.
+    struct SeedJoiner
+    {
+        chat_participant_ptr participant;
+        uint64_t resume_after;
+    };
+    bool seeding_ = false;
+    std::vector<SeedJoiner> seed_joiners_;  // guarded by mutex_
+    std::vector<message_ptr> seed_backlog_; // strand only
+
+    // Newest messages sent to a joiner; older ones are fetched on request
+    size_t join_history_ = MAX_RECENT_MSGS;
+
+public:
+    static constexpr size_t MAX_RECENT_MSGS = 100;
+
+    enum class LogRead
+    {
+        ready,  // out holds the next messages
+        idle,   // caught up; the participant will get notify_log()
+        lapped  // the cursor fell more than the log size behind
+    };
+
+    ChatRoom(uint32_t id, std::string name, std::shared_ptr<std::atomic<uint64_t>> sequence,
+             boost::asio::io_context &io_context)
+        : id_(id), name_(std::move(name)),
+          label_(id == 0 ? "" : "#" + name_ + " "),
+          sequence_(std::move(sequence)),
+          strand_(boost::asio::make_strand(io_context)),
+          batch_timer_(strand_) {}
+
+    ~ChatRoom()
+    {
+        for (InboxNode *node = inbox_.load(); node;)
+        {
+            node = release(node);
+        }
+    }
+
+    // Switches the room to shared-log delivery with the given number of
+    // slots; 0 keeps per-session queues. Call before any session joins.
+    void enable_shared_log(size_t slots)
+    {
+        log_slots_ = slots;
+    }
+
+    bool shared_log() const { return log_slots_ > 0; }
+
+    void set_join_history(size_t messages)
+    {
+        join_history_ = messages;
+    }
+
+    // window is the latency ceiling; 0 drains as soon as the strand runs
+    void set_batching(std::chrono::microseconds window, size_t max_msgs)
+    {
+        batch_window_max_ = window;
+        batch_max_msgs_ = max_msgs;
+    }
+
+    void set_metrics(ServerMetrics &metrics)
+    {
+        metrics_ = &metrics;
+    }
+
+    // helpers is the number of other threads running the room's io_context;
+    // 0 (or a chunk of 0) keeps every fan-out on the room's strand
+    void set_parallel_fan_out(size_t chunk, size_t helpers)
+    {
+        fan_out_chunk_ = chunk;
+        fan_out_helpers_ = chunk > 0 ? helpers : 0;
+    }
+
+    // The newcomer gets the latest page of history as one pre-framed replay
+    // write. A reconnecting one that has seen up to resume_after gets just
+    // the messages after that instead, or a resume_gap frame and the latest
+    // page if they are no longer all in memory. Sequence numbers are shared
+    // by all rooms, so the gap's count is an upper bound. In shared-log mode
+    // *log_cursor is set to the first message after what was sent.
+    participant_handle join(chat_participant_ptr participant, uint64_t *log_cursor = nullptr,
+                            uint64_t resume_after = 0)
+    {
+        participant_handle handle;
+        replay_ptr replay;
+
+        {
+            // Membership and history change together so the newcomer sees
+            // each message exactly once, either from history or live
+            std::lock_guard<std::mutex> lock(mutex_);
+            handle = participants_.insert(participant);
+            mark_stale(participants_.size() - 1);
+
+            if (seeding_)
+            {
+                seed_joiners_.push_back(SeedJoiner{participant, resume_after});
+            }
+            else
+            {
+                replay = join_replay(participant->format(), resume_after);
+            }
+            if (log_cursor && shared_log())
+            {
+                // Caught up by definition; woken by the next append
+                *log_cursor = log_head_;
+                log_waiters_.push_back(participant);
+            }
+        } // release lock here
+
+        if (replay)
+        {
+            participant->deliver_replay(replay);
+        }
+        return handle;
+    }
+
+    // Current history framed for format, or null if there is none.
+    // sequences, if given, gets the sequence of each message in it.
+    replay_ptr history_replay(WireFormat format, std::vector<uint64_t> *sequences = nullptr)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return replay_log(format).snapshot(SIZE_MAX, sequences);
+    }
+
+    // Up to count messages older than sequence `before` (0 = the newest),
+    // framed for format and followed by a history_end frame. Returned right
+    // away if the in-memory ring has them, or holds everything the room
+    // has; otherwise returns null and the history log's reader thread reads
+    // the rest and passes the page to done.
+    replay_ptr history_page(WireFormat format, uint64_t before, size_t count,
+                            std::function<void(replay_ptr)> done)
+    {
+        if (before == 0)
+        {
+            before = UINT64_MAX;
+        }
+
+        std::vector<message_ptr> page;
+        bool complete; // the ring has every message of the room
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (size_t i = recent_messages_.size(); i-- > 0 && page.size() < count;)
+            {
+                if (recent_messages_[i]->sequence < before)
+                {
+                    page.push_back(recent_messages_[i]);
+                }
+            }
+            complete = evicted_sequence_ == 0 && !seeding_;
+        }
+        std::reverse(page.begin(), page.end());
+
+        if (page.size() == count || complete || !history_log_)
+        {
+            uint64_t oldest = page.size() == count && !page.empty() ? page.front()->sequence : 0;
+            return finish_page(format, std::move(page), oldest);
+        }
+
+        uint64_t limit = page.empty() ? before : page.front()->sequence;
+        history_log_->read_before(id_, limit, count - page.size(),
+                                  [format, page = std::move(page), done = std::move(done)](HistoryRead older) mutable
+                                  {
+                                      page.insert(page.begin(), older.messages.begin(), older.messages.end());
+                                      done(finish_page(format, std::move(page), older.more_before));
+                                  });
+        return nullptr;
+    }
+
+    // A page followed by its history_end frame: how many messages it has and
+    // the sequence to ask before for the next one, 0 at the start
+    static replay_ptr finish_page(WireFormat format, std::vector<message_ptr> page, uint64_t more_before)
+    {
+        page.push_back(make_page_marker(FrameType::history_end, more_before, page.size()));
+        return frame_messages(format, page);
+    }
+
+    void leave(participant_handle handle, const ChatParticipant *participant = nullptr)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t position = participants_.position(handle);
+        if (participants_.erase(handle))
+        {
+            // The last participant moved into the hole
+            mark_stale(position);
+            mark_stale(participants_.size());
+        }
+
+        auto waiter = std::find_if(log_waiters_.begin(), log_waiters_.end(),
+                                   [participant](const chat_participant_ptr &p)
+                                   { return p.get() == participant; });
+        if (waiter != log_waiters_.end())
+        {
+            *waiter = std::move(log_waiters_.back());
+            log_waiters_.pop_back();
+        }
+
+        auto joiner = std::find_if(seed_joiners_.begin(), seed_joiners_.end(),
+                                   [participant](const SeedJoiner &j)
+                                   { return j.participant.get() == participant; });
+        if (joiner != seed_joiners_.end())
+        {
+            seed_joiners_.erase(joiner);
+        }
+    }
+
+    // Copies the messages after cursor, up to the caps, into out and
+    // advances cursor. When there are none the participant is registered for
+    // notify_log() under the same lock an append takes, so no wakeup is lost.
+    // A lapped cursor is moved to the head and *resync set to the current
+    // history, if any, so the caller can either replay it or give up.
+    LogRead read_log(uint64_t &cursor, size_t max_msgs, size_t max_bytes,
+                     std::vector<OutboundItem> &out, const chat_participant_ptr &participant,
+                     replay_ptr *resync)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (log_head_ - cursor > log_slots_)
+        {
+            cursor = log_head_;
+            *resync = replay_log(participant->format()).snapshot();
+            return LogRead::lapped;
+        }
+        if (cursor == log_head_)
+        {
+            log_waiters_.push_back(participant);
+            return LogRead::idle;
+        }
+
+        size_t bytes = 0;
+        while (cursor != log_head_ && out.size() < max_msgs)
+        {
+            const message_ptr &msg = log_[cursor % log_slots_];
+            if (!out.empty() && bytes + msg->length() > max_bytes)
+            {
+                break;
+            }
+            bytes += msg->length();
+            out.push_back(OutboundItem{msg, nullptr});
+            ++cursor;
+        }
+        return LogRead::ready;
+    }
+
+    // Attaches the on-disk log, keeps numbering after what it holds and, if
+    // the room has history there, seeds the in-memory history from it so a
+    // restarted server replays it to joiners. Call before any session joins.
+    void set_history_log(HistoryLog *history_log)
+    {
+        history_log_ = history_log;
+        if (!history_log_)
+        {
+            return;
+        }
+
+        uint64_t sequence = sequence_->load(std::memory_order_relaxed);
+        while (sequence < history_log_->recovered_sequence() &&
+               !sequence_->compare_exchange_weak(sequence, history_log_->recovered_sequence(),
+                                                 std::memory_order_relaxed))
+        {
+        }
+
+        if (history_log_->has_history(id_))
+        {
+            seeding_ = true;
+            auto self(shared_from_this());
+            history_log_->read_before(id_, UINT64_MAX, MAX_RECENT_MSGS,
+                                      [this, self](HistoryRead seed)
+                                      {
+                                          boost::asio::post(strand_, [this, self, seed = std::move(seed)]()
+                                                            { finish_seeding(seed); });
+                                      });
+        }
+    }
+
+    void set_publisher(CoreBus::Sink publish)
+    {
+        publish_ = std::move(publish);
+    }
+
+    uint32_t id() const { return id_; }
+    const std::string &name() const { return name_; }
+    const std::string &label() const { return label_; }
+
+    // Hands a message read from one of this room's sessions to the room.
+    // Lock-free and callable from any thread; the room's strand stamps it
+    // with the next sequence number, records and fans it out. msg is framed
+    // once by the sender; participants only queue the handle.
+    void deliver(std::shared_ptr<Message> msg)
+    {
+        PoolAllocator<InboxNode> allocator;
+        InboxNode *node = new (allocator.allocate(1))
+            InboxNode{std::move(msg), inbox_.load(std::memory_order_relaxed)};
+        while (!inbox_.compare_exchange_weak(node->next, node, std::memory_order_release,
+                                             std::memory_order_relaxed))
+        {
+        }
+        if (!drain_scheduled_.exchange(true, std::memory_order_acq_rel))
+        {
+            auto self(shared_from_this());
+            boost::asio::post(strand_, [this, self]()
+                              { wake(); });
+        }
+        if (inbox_size_.fetch_add(1, std::memory_order_relaxed) + 1 == batch_max_msgs_)
+        {
+            // A full batch does not wait for the rest of the window
+            auto self(shared_from_this());
+            boost::asio::post(strand_, [this, self]()
+                              { drain(); });
+        }
+    }
+
+    // Records and fans out an already stamped msg to this room's own
+    // participants only. Runs on strand_ like drain(), so it cannot overtake
+    // or be overtaken by a local batch.
+    void deliver_local(const message_ptr &msg)
+    {
+        auto self(shared_from_this());
+        boost::asio::dispatch(strand_, [this, self, msg]()
+                              {
+                                  if (seeding_)
+                                  {
+                                      seed_backlog_.push_back(msg);
+                                      return;
+                                  }
+                                  record_local(msg);
+                              });
+    }
+
+private:
+    // Runs on strand_
+    void record_local(const message_ptr &msg)
+    {
+        if (fan_out_running_)
+        {
+            fan_out_backlog_.push_back(msg);
+            return;
+        }
+        auto messages = make_message_batch();
+        messages->messages.push_back(msg);
+        participant_snapshot snapshot;
+        participant_list waiters;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            record(msg);
+            snapshot = recipients(waiters);
+        }
+        fan_out(std::move(snapshot), std::move(waiters), messages);
+    }
+
+    // Runs on strand_ once the log has read the room's newest messages. The
+    // read saw everything stamped before it started, so another core's
+    // message that is also in seed is not recorded twice.
+    void finish_seeding(const HistoryRead &seed)
+    {
+        std::vector<std::pair<chat_participant_ptr, replay_ptr>> replays;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const auto &msg : seed.messages)
+            {
+                remember(msg);
+            }
+            if (seed.more_before != 0)
+            {
+                // Older messages of this room are still on disk
+                uint64_t oldest = seed.messages.empty() ? seed.more_before
+                                                        : std::min(seed.more_before, seed.messages.front()->sequence);
+                evicted_sequence_ = oldest - 1;
+            }
+            seeding_ = false;
+            for (const auto &joiner : seed_joiners_)
+            {
+                replays.emplace_back(joiner.participant,
+                                     join_replay(joiner.participant->format(), joiner.resume_after));
+            }
+            seed_joiners_.clear();
+        }
+        for (const auto &replay : replays)
+        {
+            if (replay.second)
+            {
+                replay.first->deliver_replay(replay.second);
+            }
+        }
+
+        auto older = [](const message_ptr &a, const message_ptr &b)
+        { return a->sequence < b->sequence; };
+        for (const auto &msg : seed_backlog_)
+        {
+            if (!std::binary_search(seed.messages.begin(), seed.messages.end(), msg, older))
+            {
+                record_local(msg);
+            }
+        }
+        seed_backlog_.clear();
+        drain();
+    }
+
+    // Called with mutex_ held: the latest page of history, or for a
+    // resume_after within the ring's range what followed it
+    replay_ptr join_replay(WireFormat format, uint64_t resume_after) const
+    {
+        uint64_t newest = recent_messages_.size() > 0
+                              ? recent_messages_[recent_messages_.size() - 1]->sequence
+                              : 0;
+        if (resume_after > 0 && resume_after <= newest)
+        {
+            return resume_replay(format, resume_after);
+        }
+        return replay_log(format).snapshot(join_history_);
+    }
+
+    // Called with mutex_ held, for a resume_after within the ring's range
+    replay_ptr resume_replay(WireFormat format, uint64_t resume_after) const
+    {
+        std::vector<message_ptr> page;
+        size_t size = recent_messages_.size();
+        if (evicted_sequence_ <= resume_after)
+        {
+            for (size_t i = 0; i < size; ++i)
+            {
+                if (recent_messages_[i]->sequence > resume_after)
+                {
+                    page.push_back(recent_messages_[i]);
+                }
+            }
+            return page.empty() ? nullptr : frame_messages(format, page);
+        }
+
+        size_t first = size - std::min(join_history_, size);
+        uint64_t resume_at = first < size ? recent_messages_[first]->sequence
+                                          : recent_messages_[size - 1]->sequence + 1;
+        page.push_back(make_page_marker(FrameType::resume_gap, resume_at,
+                                        resume_at - resume_after - 1));
+        for (size_t i = first; i < size; ++i)
+        {
+            page.push_back(recent_messages_[i]);
+        }
+        return frame_messages(format, page);
+    }
+
+    // Runs on strand_ for the first message pushed after a drain
+    void wake()
+    {
+        if (batch_timer_armed_)
+        {
+            return; // the timer drains
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (window_.count() == 0 || now >= last_drain_ + window_)
+        {
+            drain();
+            return;
+        }
+
+        batch_timer_armed_ = true;
+        batch_timer_.expires_at(last_drain_ + window_);
+        auto self(shared_from_this());
+        batch_timer_.async_wait([this, self](boost::system::error_code ec)
+                                {
+                                    batch_timer_armed_ = false;
+                                    if (!ec)
+                                    {
+                                        drain();
+                                    }
+                                });
+    }
+
+    // Runs on strand_. Everything sent since the last drain is stamped and
+    // logged in one go and reaches each participant as one batch.
+    void drain()
+    {
+        if (seeding_ || fan_out_running_)
+        {
+            return; // finish_seeding() or end_fan_out() drains what waited
+        }
+
+        // Cleared first: a push that misses this drain schedules the next
+        drain_scheduled_.store(false, std::memory_order_release);
+        for (InboxNode *node = inbox_.exchange(nullptr, std::memory_order_acquire); node;)
+        {
+            batch_.push_back(std::move(node->msg));
+            node = release(node);
+        }
+        if (batch_.empty())
+        {
+            return;
+        }
+        std::reverse(batch_.begin(), batch_.end()); // the stack is newest first
+        inbox_size_.fetch_sub(batch_.size(), std::memory_order_relaxed);
+        adapt_window(batch_.size());
+        if (metrics_)
+        {
+            metrics_->record_room_batch(batch_.size());
+        }
+
+        if (history_log_)
+        {
+            // Only encodes into the log's batch; the disk write and fsync
+            // run on its flusher thread alongside the fan-out
+            history_log_->append(batch_, *sequence_);
+        }
+        else
+        {
+            uint64_t first = sequence_->fetch_add(batch_.size(), std::memory_order_relaxed) + 1;
+            for (size_t i = 0; i < batch_.size(); ++i)
+            {
+                batch_[i]->set_sequence(first + i);
+            }
+        }
+
+        auto messages = make_message_batch();
+        messages->messages.assign(batch_.begin(), batch_.end());
+        batch_.clear(); // keeps its capacity for the next drain
+        if (messages->messages.size() > 1 && !shared_log())
+        {
+            messages->legacy = frame_messages(WireFormat::legacy, messages->messages);
+            messages->binary = frame_messages(WireFormat::binary, messages->messages);
+        }
+
+        participant_snapshot snapshot;
+        participant_list waiters;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const auto &msg : messages->messages)
+            {
+                record(msg);
+            }
+            snapshot = recipients(waiters);
+        }
+        fan_out(std::move(snapshot), std::move(waiters), messages);
+
+        if (publish_)
+        {
+            for (const auto &msg : messages->messages)
+            {
+                publish_(msg);
+            }
+        }
+    }
+
+    void adapt_window(size_t drained)
+    {
+        last_drain_ = std::chrono::steady_clock::now();
+        // At least 1 us, or a ceiling under 16 us would never open the window
+        auto step = batch_window_max_ / 16;
+        if (batch_window_max_.count() > 0)
+        {
+            step = std::max(step, std::chrono::microseconds(1));
+        }
+        if (drained > 1)
+        {
+            window_ = std::min(batch_window_max_, std::max(window_ * 2, step));
+        }
+        else
+        {
+            window_ /= 2;
+            if (window_ < step)
+            {
+                window_ = std::chrono::microseconds(0);
+            }
+        }
+    }
+
+    static InboxNode *release(InboxNode *node)
+    {
+        InboxNode *next = node->next;
+        node->~InboxNode();
+        PoolAllocator<InboxNode>().deallocate(node, 1);
+        return next;
+    }
+
+    static message_ptr make_page_marker(FrameType type, uint64_t sequence, uint64_t count)
+    {
+        HistoryPage page;
+        page.sequence = sequence;
+        page.count = static_cast<uint32_t>(std::min<uint64_t>(count, UINT32_MAX));
+        char body[HistoryPage::SIZE];
+        page.encode(body);
+
+        auto marker = make_message();
+        marker->type = type;
+        marker->assign_body(body, sizeof(body));
+        return marker;
+    }
+
+    // One replay write of the given messages, framed for format
+    template <typename Messages>
+    static replay_ptr frame_messages(WireFormat format, const Messages &messages)
+    {
+        auto replay = std::make_shared<ReplaySnapshot>();
+        for (const auto &msg : messages)
+        {
+            size_t first = replay->buffers.size();
+            msg->append_buffers(format, replay->buffers);
+            for (size_t i = first; i < replay->buffers.size(); ++i)
+            {
+                replay->bytes += replay->buffers[i].size();
+            }
+            replay->owners.push_back(msg);
+            ++replay->messages;
+        }
+        return replay;
+    }
+
+    const ReplayLog &replay_log(WireFormat format) const
+    {
+        return format == WireFormat::legacy ? legacy_replay_ : binary_replay_;
+    }
+
+    // Called with mutex_ held
+    void record(const message_ptr &msg)
+    {
+        remember(msg);
+        if (shared_log())
+        {
+            if (log_.empty())
+            {
+                log_.assign(log_slots_, nullptr);
+            }
+            log_[log_head_ % log_slots_] = msg;
+            ++log_head_;
+        }
+    }
+
+    // Called with mutex_ held: adds msg to the history, evicting the oldest
+    void remember(const message_ptr &msg)
+    {
+        if (recent_messages_.size() == recent_messages_.capacity())
+        {
+            evicted_sequence_ = recent_messages_[0]->sequence;
+        }
+        recent_messages_.push(msg);
+        legacy_replay_.append(msg);
+        binary_replay_.append(msg);
+    }
+
+    // Called with mutex_ held after recording; returns the participants to
+    // deliver to, or in shared-log mode null and the idle participants to
+    // wake in waiters
+    participant_snapshot recipients(participant_list &waiters)
+    {
+        if (shared_log())
+        {
+            waiters.swap(log_waiters_);
+            return nullptr;
+        }
+
+        if (snapshot_stale_)
+        {
+            constexpr size_t CHUNK_SIZE = ParticipantSnapshot::CHUNK_SIZE;
+            const auto &values = participants_.values();
+            auto snapshot = std::make_shared<ParticipantSnapshot>();
+            snapshot->size = values.size();
+            for (size_t first = 0, chunk = 0; first < values.size(); first += CHUNK_SIZE, ++chunk)
+            {
+                size_t last = std::min(first + CHUNK_SIZE, values.size());
+                if (chunk < snapshot_->chunks.size() && !stale_chunks_[chunk] &&
+                    snapshot_->chunks[chunk]->size() == last - first)
+                {
+                    snapshot->chunks.push_back(snapshot_->chunks[chunk]);
+                    continue;
+                }
+                snapshot->chunks.push_back(std::make_shared<const participant_list>(
+                    values.begin() + static_cast<std::ptrdiff_t>(first),
+                    values.begin() + static_cast<std::ptrdiff_t>(last)));
+            }
+            snapshot_ = std::move(snapshot);
+            stale_chunks_.assign(snapshot_->chunks.size(), false);
+            snapshot_stale_ = false;
+        }
+        return snapshot_;
+    }
+
+    // Called with mutex_ held when the participant at position changed
+    void mark_stale(size_t position)
+    {
+        size_t chunk = position / ParticipantSnapshot::CHUNK_SIZE;
+        if (chunk >= stale_chunks_.size())
+        {
+            stale_chunks_.resize(chunk + 1, false);
+        }
+        stale_chunks_[chunk] = true;
+        snapshot_stale_ = true;
+    }
+
+    // Deliver to all participants, or wake all waiters, without holding
+    // any lock. Lists longer than two chunks are handed out in parallel.
+    // Runs on strand_.
+    void fan_out(participant_snapshot participants, participant_list waiters,
+                 const message_batch &messages)
+    {
+        if (!participants)
+        {
+            participants = ParticipantSnapshot::from(std::move(waiters));
+        }
+        if (fan_out_helpers_ == 0 || participants->size < 2 * fan_out_chunk_)
+        {
+            deliver_range(*participants, 0, participants->size, messages);
+            return;
+        }
+
+        auto work = std::make_shared<ParallelFanOut>();
+        work->participants = std::move(participants);
+        work->messages = messages;
+        work->chunk = fan_out_chunk_;
+        work->chunks = (work->participants->size + fan_out_chunk_ - 1) / fan_out_chunk_;
+
+        size_t helpers = std::min(fan_out_helpers_, work->chunks - 1);
+        auto self(shared_from_this());
+        fan_out_running_ = true;
+        for (size_t i = 0; i < helpers; ++i)
+        {
+            boost::asio::post(strand_.get_inner_executor(), [this, self, work]()
+                              {
+                                  if (run_fan_out(*work))
+                                  {
+                                      boost::asio::post(strand_, [this, self]()
+                                                        { end_fan_out(); });
+                                  }
+                              });
+        }
+        if (run_fan_out(*work))
+        {
+            fan_out_running_ = false; // no helper is left to wait for
+        }
+    }
+
+    // Returns true on the thread that finished the last chunk
+    bool run_fan_out(ParallelFanOut &work) const
+    {
+        for (;;)
+        {
+            size_t chunk = work.next.fetch_add(1, std::memory_order_relaxed);
+            if (chunk >= work.chunks)
+            {
+                return false;
+            }
+            size_t first = chunk * work.chunk;
+            deliver_range(*work.participants, first,
+                          std::min(first + work.chunk, work.participants->size), work.messages);
+            if (work.done.fetch_add(1, std::memory_order_acq_rel) + 1 == work.chunks)
+            {
+                return true;
+            }
+        }
+    }
+
+    // Runs on strand_ once a parallel fan-out's helpers are done with it
+    void end_fan_out()
+    {
+        fan_out_running_ = false;
+        while (!fan_out_running_ && !fan_out_backlog_.empty())
+        {
+            message_ptr msg = std::move(fan_out_backlog_.front());
+            fan_out_backlog_.pop_front();
+            record_local(msg);
+        }
+        drain();
+    }
+
+    // Participants [first, last) of the snapshot, walked chunk by chunk.
+    // Shared-log rooms pass no messages; their participants are woken instead.
+    void deliver_range(const ParticipantSnapshot &participants, size_t first, size_t last,
+                       const message_batch &messages) const
+    {
+        constexpr size_t CHUNK_SIZE = ParticipantSnapshot::CHUNK_SIZE;
+        while (first < last)
+        {
+            const participant_list &chunk = *participants.chunks[first / CHUNK_SIZE];
+            size_t end = std::min(last - first + first % CHUNK_SIZE, chunk.size());
+            for (size_t i = first % CHUNK_SIZE; i < end; ++i)
+            {
+                if (shared_log())
+                {
+                    chunk[i]->notify_log(id_);
+                }
+                else
+                {
+                    chunk[i]->deliver(messages);
+                }
+            }
+            first += end - first % CHUNK_SIZE;
+        }
+    }
+};
+
+// Named rooms, created on first use and kept for the life of the server.
+// Rooms are spread over shards by id, each with its own lock, so looking up
+// one room never waits on lookups of rooms in other shards. A room's id is
+// a hash of its name (0 for the lobby), so every core and every restart
+// maps a name to the same id. In per-core mode a room has one ChatRoom per
+// core, running on that core's io_context, all created together, and
+// configure() is called for each.
+class RoomRegistry
+{
+public:
+    using Configure = std::function<void(ChatRoom &room, size_t core)>;
+
+    static constexpr size_t MAX_NAME_LENGTH = 32;
+    static constexpr const char *LOBBY = "lobby";
+
+private:
+    struct Room
+    {
+        std::string name;
+        std::vector<std::shared_ptr<ChatRoom>> cores;
+        size_t members = 0; // sessions in the room, on any core
+    };
+
+    struct Shard
+    {
+        std::mutex mutex;
+        std::unordered_map<uint32_t, std::unique_ptr<Room>> rooms;
+    };
+
+    std::vector<boost::asio::io_context *> contexts_; // by core
+    std::unique_ptr<Shard[]> shards_;
+    size_t shard_count_;
+    Configure configure_;
+    std::shared_ptr<std::atomic<uint64_t>> sequence_ = std::make_shared<std::atomic<uint64_t>>(0);
+
+public:
+    RoomRegistry(std::vector<boost::asio::io_context *> contexts, size_t shard_count,
+                 Configure configure)
+        : contexts_(std::move(contexts)), shards_(new Shard[shard_count]),
+          shard_count_(shard_count), configure_(std::move(configure)) {}
+
+    // 1 to MAX_NAME_LENGTH letters, digits, '-' or '_'
+    static bool valid_name(const std::string &name)
+    {
+        if (name.empty() || name.size() > MAX_NAME_LENGTH)
+        {
+            return false;
+        }
+        return std::all_of(name.begin(), name.end(), [](char c)
+                           { return std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_'; });
+    }
+
+    // FNV-1a of the name; 0 is reserved for the lobby
+    static uint32_t room_id(const std::string &name)
+    {
+        if (name == LOBBY)
+        {
+            return 0;
+        }
+        uint32_t hash = 2166136261u;
+        for (char c : name)
+        {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+        }
+        return hash != 0 ? hash : 1;
+    }
+
+    // core's copy of the room called name, created if it does not exist yet,
+    // with the caller counted as a member until it calls release(). Null if
+    // the name is invalid or another room already has its id.
+    std::shared_ptr<ChatRoom> acquire(const std::string &name, size_t core)
+    {
+        if (!valid_name(name))
+        {
+            return nullptr;
+        }
+
+        uint32_t id = room_id(name);
+        Shard &shard = shards_[id % shard_count_];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto &room = shard.rooms[id];
+        if (!room)
+        {
+            room = std::make_unique<Room>();
+            room->name = name;
+            for (size_t i = 0; i < contexts_.size(); ++i)
+            {
+                room->cores.push_back(std::make_shared<ChatRoom>(id, name, sequence_, *contexts_[i]));
+                configure_(*room->cores.back(), i);
+            }
+        }
+        if (room->name != name)
+        {
+            return nullptr;
+        }
+        ++room->members;
+        return room->cores[core];
+    }
+
+    // A member left room id. The room is dropped with its last member,
+    // unless it is the lobby; the next join creates it afresh, with its
+    // history read back from the history log if there is one.
+    void release(uint32_t id)
+    {
+        std::unique_ptr<Room> dropped; // freed outside the shard lock
+        Shard &shard = shards_[id % shard_count_];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto room = shard.rooms.find(id);
+        if (room != shard.rooms.end() && --room->second->members == 0 && id != 0)
+        {
+            dropped = std::move(room->second);
+            shard.rooms.erase(room);
+        }
+    }
+
+    // core's copy of an existing room, or null
+    std::shared_ptr<ChatRoom> find(uint32_t id, size_t core)
+    {
+        Shard &shard = shards_[id % shard_count_];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto room = shard.rooms.find(id);
+        return room != shard.rooms.end() ? room->second->cores[core] : nullptr;
+    }
+};
+
+// Append-only overflow file, one link of a SpillQueue. Frames are appended
+// in the session's wire format once its in-memory queue is full and read
+// back sequentially as the socket drains. Named files are unlinked right after
+// creation (where the OS allows it) so they never outlive the process.
+class SpillFile
+{
+private:
+    std::FILE *file_ = nullptr;
+    std::string path_;
+    uint64_t write_offset_ = 0;
+    uint64_t read_offset_ = 0;
+    // End offset and message count of every frame not yet fully read
+    std::deque<std::pair<uint64_t, size_t>> frames_;
+
+    SpillFile() = default;
+
+public:
+    SpillFile(const SpillFile &) = delete;
+    SpillFile &operator=(const SpillFile &) = delete;
+
+    ~SpillFile()
+    {
+        if (file_)
+        {
+            std::fclose(file_);
+        }
+        if (!path_.empty())
+        {
+            std::remove(path_.c_str());
+        }
+    }
+
+    // Returns null if the file cannot be created
+    static std::unique_ptr<SpillFile> create(const std::string &dir, uint32_t session_id)
+    {
+        std::unique_ptr<SpillFile> spill(new SpillFile());
+        if (dir.empty())
+        {
+            spill->file_ = std::tmpfile();
+        }
+        else
+        {
+            auto ticks = std::chrono::steady_clock::now().time_since_epoch().count();
+            std::string path = dir + "/chat-spill-" + std::to_string(session_id) +
+                               "-" + std::to_string(ticks);
+            spill->file_ = std::fopen(path.c_str(), "w+b");
+#ifdef _WIN32
+            spill->path_ = path;
+#else
+            std::remove(path.c_str());
+#endif
+        }
+        return spill->file_ ? std::move(spill) : nullptr;
+    }
+
+    bool append(const std::vector<boost::asio::const_buffer> &buffers, size_t messages)
+    {
+        if (!seek(write_offset_))
+        {
+            return false;
+        }
+        for (const auto &buffer : buffers)
+        {
+            if (std::fwrite(buffer.data(), 1, buffer.size(), file_) != buffer.size())
+            {
+                return false;
+            }
+            write_offset_ += buffer.size();
+        }
+        frames_.emplace_back(write_offset_, messages);
+        return true;
+    }
+
+    // Reads the next unsent bytes; 0 means an I/O error if pending() > 0.
+    // messages is set to the number of frames the read completed.
+    size_t read(char *out, size_t size, size_t &messages)
+    {
+        messages = 0;
+        size = static_cast<size_t>(std::min<uint64_t>(size, pending()));
+        if (std::fflush(file_) != 0 || !seek(read_offset_))
+        {
+            return 0;
+        }
+        size_t read = std::fread(out, 1, size, file_);
+        read_offset_ += read;
+        while (!frames_.empty() && frames_.front().first <= read_offset_)
+        {
+            messages += frames_.front().second;
+            frames_.pop_front();
+        }
+        return read;
+    }
+
+    uint64_t pending() const { return write_offset_ - read_offset_; }
+    uint64_t size() const { return write_offset_; }
+
+private:
+    // fseek() takes a long, which is 32 bits on Windows
+    bool seek(uint64_t offset)
+    {
+#ifdef _WIN32
+        return _fseeki64(file_, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+        return fseeko(file_, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+    }
+};
+
+// A lagging session's overflow as a chain of spill files: appends go to
+// the newest, reads come from the oldest, and a file is closed (and so
+// deleted) once it is read out and a newer one takes the appends. The disk
+// held stays close to what is still unsent instead of growing with all the
+// session ever spilled. Only used on the SpillIo thread; an I/O error fails
+// every later read, so the session never skips past lost bytes.
+class SpillQueue
+{
+private:
+    static constexpr uint64_t FILE_BYTES = 16 * 1024 * 1024;
+
+    std::string dir_;
+    uint32_t session_id_;
+    ServerMetrics &metrics_;
+    std::deque<std::unique_ptr<SpillFile>> files_;
+    std::vector<boost::asio::const_buffer> frame_; // scratch
+    bool failed_ = false;
+
+public:
+    SpillQueue(const std::string &dir, uint32_t session_id, ServerMetrics &metrics)
+        : dir_(dir), session_id_(session_id), metrics_(metrics) {}
+
+    void append(const OutboundItem &item, WireFormat format)
+    {
+        if (failed_)
+        {
+            return;
+        }
+        if (files_.empty() || files_.back()->size() >= FILE_BYTES)
+        {
+            auto file = SpillFile::create(dir_, session_id_);
+            if (!file)
+            {
+                std::cerr << "Cannot create spill file for client " << session_id_ << std::endl;
+                failed_ = true;
+                return;
+            }
+            files_.push_back(std::move(file));
+            metrics_.spill_files.fetch_add(1, std::memory_order_relaxed);
+        }
+        frame_.clear();
+        item.append_buffers(format, frame_);
+        failed_ = !files_.back()->append(frame_, item.count());
+    }
+
+    // Reads the next unsent bytes, all from one file; 0 means an I/O error
+    size_t read(char *out, size_t size, size_t &messages)
+    {
+        messages = 0;
+        while (files_.size() > 1 && files_.front()->pending() == 0)
+        {
+            files_.pop_front();
+        }
+        if (failed_ || files_.empty())
+        {
+            return 0;
+        }
+        return files_.front()->read(out, size, messages);
+    }
+};
+
+// Runs spill file reads and writes on a thread of its own, so a lagging
+// session's disk I/O never stalls an io thread. Jobs run one at a time in
+// the order they were posted; the ones still queued at shutdown run first.
+class SpillIo
+{
+private:
+    std::mutex mutex_;
+    std::condition_variable work_;
+    std::deque<std::function<void()>> jobs_;
+    bool stopping_ = false;
+    std::thread thread_;
+
+public:
+    SpillIo()
+        : thread_([this]()
+                  { run(); })
+    {
+    }
+
+    SpillIo(const SpillIo &) = delete;
+    SpillIo &operator=(const SpillIo &) = delete;
+
+    ~SpillIo()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        work_.notify_one();
+        thread_.join();
+    }
+
+    void post(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            jobs_.push_back(std::move(job));
+        }
+        work_.notify_one();
+    }
+
+private:
+    void run()
+    {
+        for (;;)
+        {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                work_.wait(lock, [this]()
+                           { return stopping_ || !jobs_.empty(); });
+                if (jobs_.empty())
+                {
+                    return;
+                }
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+            }
+            job();
+        }
+    }
+};
+
+// Every session's socket is bound to its own strand, so all of its handlers
+// (reads, writes and deliveries from other sessions) are serialized on it.
+//
+// The wire format is negotiated from the first bytes the peer sends: binary
+// clients open with a hello frame, legacy clients send "%4d" text. A peer
+// that sends nothing before the hello timeout is treated as legacy so it
+// still receives the room history right away. The lobby is joined once the
+// format is known, since history has to be framed for this peer.
+//
+// A session can be in several rooms at once. It receives all of them and
+// sends to the active one, the room it joined or switched to last.
+class ChatSession : public ChatParticipant,
+                    public std::enable_shared_from_this<ChatSession>
+{
+private:
+    tcp::socket socket_;
+    RoomRegistry &rooms_;
+    size_t core_;
+    const ServerConfig &config_;
+    ServerMetrics &metrics_;
+    SpillIo *spill_io_; // null unless the slow consumer policy is spill
+    WireFormat format_ = WireFormat::unknown;
+    boost::asio::steady_timer hello_timer_;
+    bool joined_ = false;
+
+    // Server-assigned sender id, also rendered as "Client N: " for legacy peers
+    static std::atomic<uint32_t> next_id_;
+    uint32_t id_;
+    char label_[32];
+    size_t label_length_;
+
+    // Queued items not yet handed to a write, bounded by the send queue caps
+    std::deque<OutboundItem> write_msgs_;
+    size_t queued_msgs_ = 0; // a replay or room batch counts all its messages
+    size_t queued_bytes_ = 0;
+    bool writing_ = false;
+    bool closed_ = false;
+    bool history_pending_ = false; // a history page is being read from disk
+
+    // Each membership counts in the registry until leave_room() or
+    // close_session() releases it
+    struct Membership
+    {
+        std::shared_ptr<ChatRoom> room;
+        participant_handle handle;
+
+        // Shared-log rooms: position of the next room log message to send,
+        // and whether the room will call notify_log() before there is any
+        uint64_t log_cursor = 0;
+        bool log_waiting = false;
+
+        // After a coalesce, the sorted sequences of the replayed messages.
+        // Live messages the replay already held arrive right after it, in
+        // the room's history order, and are skipped; cleared by the first
+        // one it did not hold. In per-core mode that order is not sequence
+        // order, so a sequence range would skip messages it never held.
+        std::vector<uint64_t> resync_covered;
+    };
+
+    static constexpr size_t MAX_ROOMS_PER_SESSION = 32;
+    std::vector<Membership> memberships_;
+    size_t active_ = 0;   // index of the room chat messages go to
+    size_t next_log_ = 0; // shared-log rooms are read round-robin from here
+    size_t resyncing_ = 0; // memberships with resync_covered set
+
+    // Spill policy: while spill_ has unsent bytes every new item is appended
+    // to it, so the files drain after the RAM queue and order is preserved.
+    // spill_ is only touched by jobs on spill_io_; spill_pending_ counts the
+    // bytes posted to it and not yet read back.
+    static constexpr size_t SPILL_READ_SIZE = 64 * 1024;
+    std::shared_ptr<SpillQueue> spill_;
+    uint64_t spill_pending_ = 0;
+    std::unique_ptr<char[]> spill_buffer_;
+    std::vector<boost::asio::const_buffer> spill_frame_; // scratch
+
+    // Inbound bytes are read in bulk into read_buffer_ and every complete
+    // frame in [read_begin_, read_end_) is parsed in place. Only a frame too
+    // big for the buffer is assembled in read_msg_.
+    static constexpr size_t READ_BUFFER_SIZE = 64 * 1024;
+    std::unique_ptr<char[]> read_buffer_{new char[READ_BUFFER_SIZE]};
+    size_t read_begin_ = 0;
+    size_t read_end_ = 0;
+    Message read_msg_;
+
+    // Messages and buffers of the gather write currently in flight
+    std::vector<OutboundItem> write_batch_;
+    std::vector<boost::asio::const_buffer> write_buffers_;
+
+public:
+    ChatSession(tcp::socket socket, RoomRegistry &rooms, size_t core,
+                const ServerConfig &config, ServerMetrics &metrics, SpillIo *spill_io)
+        : socket_(std::move(socket)), rooms_(rooms), core_(core),
+          config_(config), metrics_(metrics), spill_io_(spill_io),
+          hello_timer_(socket_.get_executor()),
+          id_(next_id_.fetch_add(1, std::memory_order_relaxed) + 1)
+    {
+        int written = std::snprintf(label_, sizeof(label_), "Client %u: ", id_);
+        label_length_ = static_cast<size_t>(std::max(written, 0));
+    }
+
+    void start()
+    {
+        auto self(shared_from_this());
+        hello_timer_.expires_after(std::chrono::milliseconds(config_.hello_timeout_ms));
+        hello_timer_.async_wait([this, self](boost::system::error_code ec)
+                                {
+                                    if (!ec && format_ == WireFormat::unknown)
+                                    {
+                                        set_format(WireFormat::legacy);
+                                    }
+                                });
+        do_read();
+    }
+
+    WireFormat format() const override
+    {
+        return format_;
+    }
+
+    // A framed batch is queued as one item, unless a coalesce left some of
+    // its messages to be skipped. Covered messages come first, so if the
+    // first message of a batch is not covered none is.
+    void deliver(const message_batch &batch) override
+    {
+        auto self(shared_from_this());
+        boost::asio::dispatch(socket_.get_executor(),
+                              [this, self, batch]()
+                              {
+                                  const replay_ptr &framed = batch->framed(format_);
+                                  if (framed && !covered_by_resync(*batch->messages.front()))
+                                  {
+                                      queue_item(OutboundItem{nullptr, framed});
+                                      return;
+                                  }
+                                  for (const auto &msg : batch->messages)
+                                  {
+                                      queue_item(OutboundItem{msg, nullptr});
+                                  }
+                              });
+    }
+
+    void deliver_replay(const replay_ptr &replay) override
+    {
+        enqueue(OutboundItem{nullptr, replay});
+    }
+
+    void notify_log(uint32_t room_id) override
+    {
+        auto self(shared_from_this());
+        boost::asio::dispatch(socket_.get_executor(),
+                              [this, self, room_id]()
+                              {
+                                  Membership *membership = find_membership(room_id);
+                                  if (membership)
+                                  {
+                                      membership->log_waiting = false;
+                                  }
+                                  if (!writing_ && !closed_)
+                                  {
+                                      writing_ = true;
+                                      do_write();
+                                  }
+                              });
+    }
+
+private:
+    // Callable from any thread; the queue is only touched on the strand
+    void enqueue(OutboundItem item)
+    {
+        auto self(shared_from_this());
+        boost::asio::dispatch(socket_.get_executor(),
+                              [this, self, item = std::move(item)]() mutable
+                              {
+                                  queue_item(std::move(item));
+                              });
+    }
+
+    void queue_item(OutboundItem item)
+    {
+        if (closed_ || (item.msg && covered_by_resync(*item.msg)))
+        {
+            return;
+        }
+
+        if (spill_pending_ > 0)
+        {
+            spill(item);
+            return;
+        }
+
+        if (send_queue_full())
+        {
+            metrics_.slow_consumer_events.fetch_add(1, std::memory_order_relaxed);
+            switch (config_.slow_consumer_policy)
+            {
+            case SlowConsumerPolicy::drop_newest:
+                metrics_.slow_consumer_drops.fetch_add(1, std::memory_order_relaxed);
+                return;
+
+            case SlowConsumerPolicy::drop_oldest:
+                while (!write_msgs_.empty() && send_queue_full())
+                {
+                    metrics_.slow_consumer_drops.fetch_add(write_msgs_.front().count(),
+                                                           std::memory_order_relaxed);
+                    pop_queued();
+                }
+                break;
+
+            case SlowConsumerPolicy::disconnect:
+                metrics_.slow_consumer_disconnects.fetch_add(1, std::memory_order_relaxed);
+                disconnect();
+                return;
+
+            case SlowConsumerPolicy::coalesce:
+                coalesce();
+                return;
+
+            case SlowConsumerPolicy::spill:
+                spill(item);
+                return;
+            }
+        }
+
+        push_queued(std::move(item));
+    }
+
+    // A single item is accepted onto a queue below the caps even if it is
+    // bigger than them, so a large history replay never trips the policy
+    bool send_queue_full() const
+    {
+        return queued_msgs_ >= config_.send_queue_max_msgs ||
+               queued_bytes_ >= config_.send_queue_max_bytes;
+    }
+
+    void push_queued(OutboundItem item)
+    {
+        queued_msgs_ += item.count();
+        queued_bytes_ += item.size();
+        write_msgs_.push_back(std::move(item));
+        metrics_.record_send_queue(queued_msgs_, queued_bytes_);
+
+        if (!writing_)
+        {
+            writing_ = true;
+            do_write();
+        }
+    }
+
+    void pop_queued()
+    {
+        queued_msgs_ -= write_msgs_.front().count();
+        queued_bytes_ -= write_msgs_.front().size();
+        write_msgs_.pop_front();
+    }
+
+    Membership *find_membership(uint32_t room_id)
+    {
+        for (auto &membership : memberships_)
+        {
+            if (membership.room->id() == room_id)
+            {
+                return &membership;
+            }
+        }
+        return nullptr;
+    }
+
+    bool covered_by_resync(const Message &msg)
+    {
+        if (resyncing_ == 0 || msg.sequence == 0)
+        {
+            return false;
+        }
+        Membership *membership = find_membership(msg.room_id);
+        if (!membership || membership->resync_covered.empty())
+        {
+            return false;
+        }
+        const auto &covered = membership->resync_covered;
+        if (std::binary_search(covered.begin(), covered.end(), msg.sequence))
+        {
+            return true;
+        }
+        // Live messages have caught up with the replay
+        membership->resync_covered.clear();
+        membership->resync_covered.shrink_to_fit();
+        --resyncing_;
+        return false;
+    }
+
+    // Drops the backlog in favour of each room's latest history, which
+    // already includes the message that overflowed the queue
+    void coalesce()
+    {
+        metrics_.slow_consumer_drops.fetch_add(queued_msgs_, std::memory_order_relaxed);
+        write_msgs_.clear();
+        queued_msgs_ = 0;
+        queued_bytes_ = 0;
+
+        for (auto &membership : memberships_)
+        {
+            std::vector<uint64_t> sequences;
+            replay_ptr replay = membership.room->history_replay(format_, &sequences);
+            if (replay)
+            {
+                if (membership.resync_covered.empty())
+                {
+                    ++resyncing_;
+                }
+                std::sort(sequences.begin(), sequences.end());
+                membership.resync_covered = std::move(sequences);
+                push_queued(OutboundItem{nullptr, replay});
+            }
+        }
+    }
+
+    // Capped on the bytes still unsent, not all the session ever spilled
+    void spill(const OutboundItem &item)
+    {
+        spill_frame_.clear();
+        item.append_buffers(format_, spill_frame_);
+        size_t frame_size = boost::asio::buffer_size(spill_frame_);
+        if (spill_pending_ + frame_size > config_.spill_max_bytes)
+        {
+            metrics_.slow_consumer_disconnects.fetch_add(1, std::memory_order_relaxed);
+            disconnect();
+            return;
+        }
+        if (!spill_)
+        {
+            spill_ = std::make_shared<SpillQueue>(config_.spill_dir, id_, metrics_);
+        }
+        spill_pending_ += frame_size;
+        spill_io_->post([spill = spill_, item, format = format_]()
+                        { spill->append(item, format); });
+        metrics_.spilled_bytes.fetch_add(frame_size, std::memory_order_relaxed);
+
+        if (!writing_)
+        {
+            writing_ = true;
+            do_write();
+        }
+    }
+
+    void disconnect()
+    {
+        boost::system::error_code ignored;
+        socket_.shutdown(tcp::socket::shutdown_both, ignored);
+        socket_.close(ignored);
+        close_session();
+    }
+
+    // Legacy peers join right away; binary ones on their first frame, which
+    // may be a hello asking to resume
+    void set_format(WireFormat format)
+    {
+        format_ = format;
+        hello_timer_.cancel();
+        if (format_ == WireFormat::legacy)
+        {
+            join_room(0);
+        }
+    }
+
+    void join_room(uint64_t resume_after)
+    {
+        joined_ = true;
+        enter_room(rooms_.acquire(RoomRegistry::LOBBY, core_), resume_after);
+    }
+
+    // Queuing the history can close the session (slow consumer policy)
+    void enter_room(std::shared_ptr<ChatRoom> room, uint64_t resume_after = 0)
+    {
+        Membership membership;
+        membership.room = room;
+        membership.handle = room->join(shared_from_this(), &membership.log_cursor, resume_after);
+        membership.log_waiting = room->shared_log();
+        if (closed_)
+        {
+            room->leave(membership.handle, this);
+            rooms_.release(room->id());
+            return;
+        }
+        memberships_.push_back(std::move(membership));
+    }
+
+    // "/join name" and "/switch name" make the room active, joining it if
+    // needed; /switch also leaves the previously active room. "/leave"
+    // leaves the named or the active room. Other text is chat.
+    bool handle_command(const char *body, size_t body_length)
+    {
+        std::string line(body, body_length);
+        line.erase(line.find_last_not_of(" \t\r\n") + 1);
+        size_t space = line.find(' ');
+        std::string command = line.substr(0, space);
+        std::string name = space == std::string::npos ? "" : line.substr(space + 1);
+
+        if (command == "/join" || command == "/switch")
+        {
+            switch_room(name, command == "/switch");
+        }
+        else if (command == "/leave")
+        {
+            Membership *membership = name.empty() ? &memberships_[active_]
+                                                  : find_membership(RoomRegistry::room_id(name));
+            if (!membership || memberships_.size() == 1)
+            {
+                send_room_notice(RoomEvent::refused, 0, name);
+            }
+            else
+            {
+                leave_room(static_cast<size_t>(membership - memberships_.data()));
+            }
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
+
+    void switch_room(const std::string &name, bool leave_current)
+    {
+        Membership *membership = find_membership(RoomRegistry::room_id(name));
+        std::shared_ptr<ChatRoom> room;
+        if (membership && membership->room->name() == name)
+        {
+            room = membership->room;
+        }
+        else if (!membership && memberships_.size() < MAX_ROOMS_PER_SESSION)
+        {
+            room = rooms_.acquire(name, core_);
+        }
+        if (!room)
+        {
+            send_room_notice(RoomEvent::refused, 0, name);
+            return;
+        }
+
+        std::shared_ptr<ChatRoom> current = memberships_[active_].room;
+        if (!membership)
+        {
+            // The notice goes out ahead of the room's history
+            send_room_notice(RoomEvent::joined, room->id(), room->name());
+            if (closed_)
+            {
+                rooms_.release(room->id());
+                return;
+            }
+            enter_room(room);
+            if (closed_)
+            {
+                return;
+            }
+            membership = &memberships_.back();
+        }
+        active_ = static_cast<size_t>(membership - memberships_.data());
+        send_room_notice(RoomEvent::active, room->id(), room->name());
+
+        if (leave_current && current != room && !closed_)
+        {
+            leave_room(static_cast<size_t>(find_membership(current->id()) - memberships_.data()));
+        }
+    }
+
+    // Never leaves the session without a room
+    void leave_room(size_t index)
+    {
+        std::shared_ptr<ChatRoom> room = std::move(memberships_[index].room);
+        room->leave(memberships_[index].handle, this);
+        rooms_.release(room->id());
+        if (!memberships_[index].resync_covered.empty())
+        {
+            --resyncing_;
+        }
+        memberships_.erase(memberships_.begin() + static_cast<std::ptrdiff_t>(index));
+        send_room_notice(RoomEvent::left, room->id(), room->name());
+
+        if (index < active_)
+        {
+            --active_;
+        }
+        else if (index == active_ && !closed_)
+        {
+            active_ = 0;
+            send_room_notice(RoomEvent::active, memberships_[0].room->id(),
+                             memberships_[0].room->name());
+        }
+    }
+
+    // room_info for binary peers, a text line for legacy ones. Notices have
+    // no sequence, so they are never skipped as covered by a resync.
+    void send_room_notice(RoomEvent event, uint32_t room_id, const std::string &name)
+    {
+        RoomInfo info;
+        info.room_id = room_id;
+        info.event = event;
+        info.name = name.substr(0, RoomRegistry::MAX_NAME_LENGTH);
+
+        auto notice = make_message();
+        if (format_ == WireFormat::binary)
+        {
+            std::string body = info.encode();
+            notice->type = FrameType::room_info;
+            notice->assign_body(body.data(), body.size());
+        }
+        else
+        {
+            std::string text = info.describe();
+            notice->assign_body(text.data(), text.size());
+        }
+        enqueue(OutboundItem{notice, nullptr});
+    }
+
+    void close_session()
+    {
+        closed_ = true;
+        write_msgs_.clear();
+        queued_msgs_ = 0;
+        queued_bytes_ = 0;
+        release_spill();
+        hello_timer_.cancel();
+        for (const auto &membership : memberships_)
+        {
+            membership.room->leave(membership.handle, this);
+            rooms_.release(membership.room->id());
+        }
+        memberships_.clear();
+        resyncing_ = 0;
+    }
+
+    void do_read()
+    {
+        auto self(shared_from_this());
+        socket_.async_read_some(boost::asio::buffer(read_buffer_.get() + read_end_,
+                                                    READ_BUFFER_SIZE - read_end_),
+                                [this, self](boost::system::error_code ec, std::size_t length)
+                                {
+                                    if (ec)
+                                    {
+                                        close_session();
+                                        return;
+                                    }
+
+                                    read_end_ += length;
+                                    if (parse_frames())
+                                    {
+                                        do_read();
+                                    }
+                                });
+    }
+
+    // Handles every complete frame in the buffer. Returns false if the
+    // session was closed, a large body read was started instead, or a
+    // history page is being read; resume_reading() continues after that.
+    bool parse_frames()
+    {
+        size_t frames = 0;
+        bool keep_reading = true;
+
+        while (!history_pending_ && read_end_ - read_begin_ >= Message::LEGACY_HEADER_SIZE)
+        {
+            const char *frame = read_buffer_.get() + read_begin_;
+            size_t available = read_end_ - read_begin_;
+
+            // The first 4 bytes are a whole legacy header or half a binary one
+            WireFormat format = Message::is_binary_header(frame) ? WireFormat::binary
+                                                                 : WireFormat::legacy;
+            if (format_ == WireFormat::unknown)
+            {
+                set_format(format);
+            }
+            if (format != format_)
+            {
+                keep_reading = false;
+                break;
+            }
+
+            size_t header_size = Message::LEGACY_HEADER_SIZE;
+            bool valid;
+            if (format_ == WireFormat::binary)
+            {
+                header_size = Message::HEADER_SIZE;
+                if (available < header_size)
+                {
+                    break;
+                }
+                std::memcpy(read_msg_.header, frame, header_size);
+                valid = read_msg_.decode_header(config_.max_body_size);
+            }
+            else
+            {
+                valid = read_msg_.decode_legacy_header(frame, config_.max_body_size);
+            }
+            if (!valid)
+            {
+                keep_reading = false;
+                break;
+            }
 
-        {
-            std::lock_guard<std::mutex> lock(mutex_);
-            participants_.insert(participant);
+            size_t frame_size = header_size + read_msg_.body_length;
+            if (available >= frame_size)
+            {
+                handle_frame(read_msg_.type, frame + header_size, read_msg_.body_length);
+                read_begin_ += frame_size;
+                ++frames;
+                continue;
+            }
 
-            // copy queue and extract messages into vector while still holding lock
-            std::queue<Message> copy{recent_messages_};
-            while (!copy.empty())
+            if (frame_size > READ_BUFFER_SIZE)
             {
-                recent.push_back(copy.front());
-                copy.pop();
+                // Move what we have of the body out and read the rest straight into it
+                size_t have = available - header_size;
+                read_msg_.reserve_body();
+                std::memcpy(read_msg_.body(), frame + header_size, have);
+                read_begin_ = read_end_ = 0;
+                do_read_large_body(have);
+                metrics_.record_read(frames);
+                return false;
             }
-        } // release lock here
+            break;
+        }
+
+        metrics_.record_read(frames);
+        if (!keep_reading)
+        {
+            close_session();
+            return false;
+        }
 
-        for (const auto &msg : recent)
+        // Move a partial frame to the front so the next read can complete it
+        size_t remaining = read_end_ - read_begin_;
+        if (read_begin_ > 0)
         {
-            participant->deliver(msg);
+            std::memmove(read_buffer_.get(), read_buffer_.get() + read_begin_, remaining);
+            read_begin_ = 0;
+            read_end_ = remaining;
         }
+        return !history_pending_;
     }
 
-    void leave(chat_participant_ptr participant)
+    void resume_reading()
     {
-        std::lock_guard<std::mutex> lock(mutex_);
-        participants_.erase(participant);
+        if (parse_frames())
+        {
+            do_read();
+        }
     }
 
-    void deliver(const Message &msg)
+    void do_read_large_body(size_t have)
     {
-        std::lock_guard<std::mutex> lock(mutex_);
+        auto self(shared_from_this());
+        boost::asio::async_read(socket_,
+                                boost::asio::buffer(read_msg_.body() + have,
+                                                    read_msg_.body_length - have),
+                                [this, self](boost::system::error_code ec, std::size_t /*length*/)
+                                {
+                                    if (ec)
+                                    {
+                                        close_session();
+                                        return;
+                                    }
 
-        // Add to recent messages
-        recent_messages_.push(msg);
-        while (recent_messages_.size() > MAX_RECENT_MSGS)
+                                    handle_frame(read_msg_.type, read_msg_.body(), read_msg_.body_length);
+                                    read_msg_.trim_body(0);
+                                    metrics_.record_read(1);
+                                    if (!history_pending_)
+                                    {
+                                        do_read();
+                                    }
+                                });
+    }
+
+    // A page that has to come from disk is posted back to the session's
+    // strand; until then no further frames are parsed, so a client has at
+    // most one read queued on the history log
+    void request_history(ChatRoom &room, const HistoryPage &request)
+    {
+        size_t count = std::min<size_t>(request.count, config_.history_page_max);
+        auto self(shared_from_this());
+        replay_ptr page = room.history_page(
+            format_, request.sequence, count,
+            [this, self](replay_ptr page)
+            {
+                boost::asio::post(socket_.get_executor(),
+                                  [this, self, page]()
+                                  {
+                                      history_pending_ = false;
+                                      if (!closed_)
+                                      {
+                                          deliver_replay(page);
+                                          resume_reading();
+                                      }
+                                  });
+            });
+        if (page)
         {
-            recent_messages_.pop();
+            deliver_replay(page);
         }
-
-        // Deliver to all participants
-        for (auto participant : participants_)
+        else
         {
-            participant->deliver(msg);
+            history_pending_ = true;
         }
     }
-};
 
-class ChatSession : public ChatParticipant,
-                    public std::enable_shared_from_this<ChatSession>
-{
-private:
-    tcp::socket socket_;
-    ChatRoom &room_;
-    Message read_msg_;
-    std::queue<Message> write_msgs_;
-    std::mutex write_mutex_;
-    std::atomic<bool> writing_{false};
+    // hello only settles the format and resume point; unknown types are skipped
+    void handle_frame(FrameType type, const char *body, size_t body_length)
+    {
+        if (!joined_)
+        {
+            bool resume = type == FrameType::hello && body_length >= 8;
+            join_room(resume ? read_le(body, 8) : 0);
+        }
+        if (memberships_.empty())
+        {
+            return; // closed
+        }
+        ChatRoom &room = *memberships_[active_].room;
 
-public:
-    ChatSession(tcp::socket socket, ChatRoom &room)
-        : socket_(std::move(socket)), room_(room) {}
+        HistoryPage request;
+        if (type == FrameType::history_request &&
+            HistoryPage::decode(body, body_length, request))
+        {
+            request_history(room, request);
+            return;
+        }
+        if (type != FrameType::chat ||
+            (body_length > 0 && body[0] == '/' && handle_command(body, body_length)))
+        {
+            return;
+        }
 
-    void start()
-    {
-        room_.join(shared_from_this());
-        do_read_header();
+        // Envelope fields for binary peers, "[timestamp] Client N: " text for
+        // legacy ones; the body is copied once into the pooled message
+        auto now = std::chrono::system_clock::now();
+        Envelope envelope;
+        envelope.timestamp_ns = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count());
+        envelope.sender_id = id_;
+        envelope.room_id = room.id();
+
+        const TimestampCache::Prefix &prefix =
+            TimestampCache::current(std::chrono::system_clock::to_time_t(now));
+
+        auto response = make_message();
+        response->set_envelope(envelope);
+        response->append_legacy_prefix(prefix.text, prefix.length);
+        response->append_legacy_prefix(room.label().data(), room.label().size());
+        response->append_legacy_prefix(label_, label_length_);
+        response->assign_body(body, body_length);
+
+        room.deliver(std::move(response));
     }
 
-    void deliver(const Message &msg) override
+    void do_write()
     {
-        bool write_in_progress = writing_.exchange(true);
+        // Drain as much of the queue as the caps allow into one writev
+        write_batch_.clear();
+        size_t batch_bytes = 0;
+        while (!write_msgs_.empty() &&
+               write_batch_.size() < config_.write_batch_max_msgs)
+        {
+            OutboundItem &item = write_msgs_.front();
+            if (!write_batch_.empty() &&
+                batch_bytes + item.size() > config_.write_batch_max_bytes)
+            {
+                break;
+            }
+            batch_bytes += item.size();
+            queued_msgs_ -= item.count();
+            queued_bytes_ -= item.size();
+            write_batch_.push_back(std::move(item));
+            write_msgs_.pop_front();
+        }
 
+        if (write_batch_.empty() && config_.room_log_size > 0 && !closed_)
         {
-            std::lock_guard<std::mutex> lock(write_mutex_);
-            write_msgs_.push(msg);
+            if (!read_room_log())
+            {
+                return;
+            }
         }
 
-        if (!write_in_progress)
+        if (write_batch_.empty())
         {
-            do_write();
+            do_write_spill();
+            return;
         }
+
+        write_buffers_.clear();
+        size_t batch_msgs = 0;
+        for (const auto &item : write_batch_)
+        {
+            item.append_buffers(format_, write_buffers_);
+            batch_msgs += item.count();
+        }
+        metrics_.record_write_batch(batch_msgs);
+
+        // write_batch_ keeps the shared bytes alive until the handler runs
+        auto self(shared_from_this());
+        boost::asio::async_write(socket_, write_buffers_,
+                                 [this, self](boost::system::error_code ec, std::size_t /*length*/)
+                                 {
+                                     if (!ec)
+                                     {
+                                         do_write();
+                                     }
+                                     else
+                                     {
+                                         close_session();
+                                     }
+                                 });
     }
 
-private:
-    void do_read_header()
+    // Fills write_batch_ from the log of one room, taking the rooms in turn.
+    // Returns false if there is nothing to write: the session is idle until
+    // notify_log(), or was disconnected.
+    bool read_room_log()
     {
-        auto self(shared_from_this());
-        boost::asio::async_read(socket_,
-                                boost::asio::buffer(read_msg_.data, Message::HEADER_SIZE),
-                                [this, self](boost::system::error_code ec, std::size_t /*length*/)
-                                {
-                                    if (!ec && read_msg_.decode_header())
-                                    {
-                                        do_read_body();
-                                    }
-                                    else
-                                    {
-                                        room_.leave(shared_from_this());
-                                    }
-                                });
+        for (size_t i = 0; i < memberships_.size(); ++i)
+        {
+            Membership &membership = memberships_[(next_log_ + i) % memberships_.size()];
+            if (membership.log_waiting)
+            {
+                continue;
+            }
+
+            replay_ptr resync;
+            switch (membership.room->read_log(membership.log_cursor, config_.write_batch_max_msgs,
+                                              config_.write_batch_max_bytes, write_batch_,
+                                              shared_from_this(), &resync))
+            {
+            case ChatRoom::LogRead::ready:
+                next_log_ = next_log_ + i + 1;
+                return true;
+
+            case ChatRoom::LogRead::idle:
+                membership.log_waiting = true;
+                break;
+
+            case ChatRoom::LogRead::lapped:
+                metrics_.slow_consumer_events.fetch_add(1, std::memory_order_relaxed);
+                if (config_.slow_consumer_policy == SlowConsumerPolicy::disconnect || !resync)
+                {
+                    metrics_.slow_consumer_disconnects.fetch_add(1, std::memory_order_relaxed);
+                    disconnect();
+                    return false;
+                }
+                write_batch_.push_back(OutboundItem{nullptr, std::move(resync)});
+                return true;
+            }
+        }
+        writing_ = false;
+        return false;
+    }
+
+    // Its files are closed, and so deleted, on the spill thread
+    void release_spill()
+    {
+        if (spill_)
+        {
+            spill_io_->post([spill = std::move(spill_)]() {});
+        }
+        spill_pending_ = 0;
     }
 
-    void do_read_body()
+    // Streams the spill files back once the RAM queue is empty. The read
+    // runs on the spill thread and hands the bytes back to the strand.
+    void do_write_spill()
     {
+        if (!spill_ || closed_)
+        {
+            writing_ = false;
+            return;
+        }
+        if (spill_pending_ == 0)
+        {
+            release_spill();
+            spill_buffer_.reset();
+            writing_ = false;
+            return;
+        }
+
+        if (!spill_buffer_)
+        {
+            spill_buffer_.reset(new char[SPILL_READ_SIZE]);
+        }
         auto self(shared_from_this());
-        boost::asio::async_read(socket_,
-                                boost::asio::buffer(read_msg_.body(), read_msg_.body_length),
-                                [this, self](boost::system::error_code ec, std::size_t /*length*/)
-                                {
-                                    if (!ec)
-                                    {
-                                        // Add timestamp and client info
-                                        auto now = std::time(nullptr);
-                                        std::string timestamp = std::ctime(&now);
-                                        timestamp.pop_back(); // Remove newline
-
-                                        std::string formatted_msg = "[" + timestamp + "] Client: " +
-                                                                    std::string(read_msg_.body(), read_msg_.body_length);
-
-                                        Message response;
-                                        response.body_length = std::min(formatted_msg.size(),
-                                                                        static_cast<size_t>(Message::MAX_BODY_SIZE));
-                                        std::memcpy(response.body(), formatted_msg.c_str(), response.body_length);
-                                        response.encode_header();
-
-                                        room_.deliver(response);
-                                        do_read_header();
-                                    }
-                                    else
-                                    {
-                                        room_.leave(shared_from_this());
-                                    }
-                                });
+        spill_io_->post([this, self, spill = spill_, buffer = spill_buffer_.get()]()
+                        {
+                            size_t messages = 0;
+                            size_t length = spill->read(buffer, SPILL_READ_SIZE, messages);
+                            boost::asio::post(socket_.get_executor(),
+                                              [this, self, length, messages]()
+                                              { write_spilled(length, messages); });
+                        });
     }
 
-    void do_write()
+    void write_spilled(size_t length, size_t messages)
     {
-        Message msg;
+        if (closed_)
         {
-            std::lock_guard<std::mutex> lock(write_mutex_);
-            if (write_msgs_.empty())
-            {
-                writing_ = false;
-                return;
-            }
-            msg = write_msgs_.front();
-            write_msgs_.pop();
+            writing_ = false;
+            return;
+        }
+        if (length == 0)
+        {
+            disconnect();
+            return;
         }
+        spill_pending_ -= length;
+        metrics_.record_write_batch(messages);
 
         auto self(shared_from_this());
-        boost::asio::async_write(socket_,
-                                 boost::asio::buffer(msg.data, msg.length()),
+        boost::asio::async_write(socket_, boost::asio::buffer(spill_buffer_.get(), length),
                                  [this, self](boost::system::error_code ec, std::size_t /*length*/)
                                  {
                                      if (!ec)
@@ -180,30 +2895,56 @@ private:
                                      }
                                      else
                                      {
-                                         room_.leave(shared_from_this());
-                                         writing_ = false;
+                                         close_session();
                                      }
                                  });
     }
 };
 
+std::atomic<uint32_t> ChatSession::next_id_{0};
+
+// Accepts connections on one io_context; sessions stay on that io_context.
+// In per-core mode there is one ChatServer per core sharing the port.
 class ChatServer
 {
 private:
+    boost::asio::io_context &io_context_;
     tcp::acceptor acceptor_;
-    ChatRoom room_;
+    RoomRegistry &rooms_;
+    size_t core_;
+    const ServerConfig &config_;
+    ServerMetrics &metrics_;
+    SpillIo *spill_io_;
 
 public:
-    ChatServer(boost::asio::io_context &io_context, const tcp::endpoint &endpoint)
-        : acceptor_(io_context, endpoint)
+    ChatServer(boost::asio::io_context &io_context, const tcp::endpoint &endpoint,
+               RoomRegistry &rooms, size_t core, const ServerConfig &config,
+               ServerMetrics &metrics, SpillIo *spill_io)
+        : io_context_(io_context), acceptor_(io_context), rooms_(rooms), core_(core),
+          config_(config), metrics_(metrics), spill_io_(spill_io)
     {
+        acceptor_.open(endpoint.protocol());
+        acceptor_.set_option(tcp::acceptor::reuse_address(true));
+        if (config_.per_core)
+        {
+#ifdef SO_REUSEPORT
+            acceptor_.set_option(reuse_port(true));
+#else
+            throw std::runtime_error("per-core mode requires SO_REUSEPORT");
+#endif
+        }
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
+
         do_accept();
     }
 
 private:
     void do_accept()
     {
+        // Each accepted socket gets its own strand
         acceptor_.async_accept(
+            boost::asio::make_strand(io_context_),
             [this](boost::system::error_code ec, tcp::socket socket)
             {
                 if (!ec)
@@ -211,43 +2952,354 @@ private:
                     std::cout << "New client connected from: "
                               << socket.remote_endpoint() << std::endl;
 
-                    std::make_shared<ChatSession>(std::move(socket), room_)->start();
+                    std::make_shared<ChatSession>(std::move(socket), rooms_, core_,
+                                                  config_, metrics_, spill_io_)
+                        ->start();
                 }
                 do_accept();
             });
     }
 };
 
-int main(int argc, char *argv[])
+// Periodically prints ServerMetrics while the io_context runs
+class MetricsReporter
 {
-    try
+private:
+    boost::asio::steady_timer timer_;
+    std::chrono::seconds interval_;
+    const ServerMetrics &metrics_;
+
+public:
+    MetricsReporter(boost::asio::io_context &io_context, unsigned interval_sec,
+                    const ServerMetrics &metrics)
+        : timer_(io_context), interval_(interval_sec), metrics_(metrics)
+    {
+        if (interval_sec > 0)
+        {
+            do_wait();
+        }
+    }
+
+private:
+    void do_wait()
+    {
+        timer_.expires_after(interval_);
+        timer_.async_wait(
+            [this](boost::system::error_code ec)
+            {
+                if (!ec)
+                {
+                    metrics_.report(std::cout);
+                    do_wait();
+                }
+            });
+    }
+};
+
+SlowConsumerPolicy parse_slow_consumer_policy(const std::string &value)
+{
+    if (value == "drop-oldest")
+    {
+        return SlowConsumerPolicy::drop_oldest;
+    }
+    if (value == "drop-newest")
+    {
+        return SlowConsumerPolicy::drop_newest;
+    }
+    if (value == "disconnect")
+    {
+        return SlowConsumerPolicy::disconnect;
+    }
+    if (value == "coalesce")
+    {
+        return SlowConsumerPolicy::coalesce;
+    }
+    if (value == "spill")
     {
-        unsigned short port = DEFAULT_PORT;
-        if (argc > 1)
+        return SlowConsumerPolicy::spill;
+    }
+    throw std::invalid_argument("unknown slow consumer policy " + value);
+}
+
+// Accepts "[port] [--option=value ...]"
+ServerConfig parse_args(int argc, char *argv[])
+{
+    ServerConfig config;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0)
+        {
+            config.port = static_cast<unsigned short>(std::atoi(arg.c_str()));
+            continue;
+        }
+
+        auto eq = arg.find('=');
+        std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+        if (name == "write-batch-msgs")
+        {
+            config.write_batch_max_msgs = std::max<size_t>(1, std::stoul(value));
+        }
+        else if (name == "write-batch-bytes")
+        {
+            config.write_batch_max_bytes = std::stoul(value);
+        }
+        else if (name == "stats-interval")
+        {
+            config.stats_interval_sec = static_cast<unsigned>(std::stoul(value));
+        }
+        else if (name == "threads")
+        {
+            config.threads = std::stoul(value);
+        }
+        else if (name == "per-core")
+        {
+            config.per_core = true;
+        }
+        else if (name == "max-body-size")
+        {
+            config.max_body_size = std::stoul(value);
+        }
+        else if (name == "send-queue-msgs")
+        {
+            config.send_queue_max_msgs = std::max<size_t>(1, std::stoul(value));
+        }
+        else if (name == "send-queue-bytes")
+        {
+            config.send_queue_max_bytes = std::stoul(value);
+        }
+        else if (name == "slow-consumer-policy")
+        {
+            config.slow_consumer_policy = parse_slow_consumer_policy(value);
+        }
+        else if (name == "spill-dir")
+        {
+            config.spill_dir = value;
+        }
+        else if (name == "spill-max-bytes")
+        {
+            config.spill_max_bytes = std::stoull(value);
+        }
+        else if (name == "history-dir")
+        {
+#ifdef _WIN32
+            throw std::invalid_argument("--history-dir is not supported on Windows");
+#else
+            config.history_dir = value;
+#endif
+        }
+        else if (name == "history-segment-bytes")
+        {
+            config.history_segment_bytes = std::max<uint64_t>(4096, std::stoull(value));
+        }
+        else if (name == "history-flush-ms")
+        {
+            config.history_flush_ms = static_cast<unsigned>(std::stoul(value));
+        }
+        else if (name == "history-read-segments")
+        {
+            config.history_read_segments = std::max<size_t>(1, std::stoul(value));
+        }
+        else if (name == "history-retain-segments")
+        {
+            config.history_retain_segments = std::stoul(value);
+        }
+        else if (name == "hello-timeout-ms")
+        {
+            config.hello_timeout_ms = static_cast<unsigned>(std::stoul(value));
+        }
+        else if (name == "join-history")
+        {
+            config.join_history = std::stoul(value);
+        }
+        else if (name == "history-page-max")
+        {
+            config.history_page_max = std::stoul(value);
+        }
+        else if (name == "room-log")
+        {
+            config.room_log_size = std::stoul(value);
+        }
+        else if (name == "batch-window-us")
+        {
+            config.batch_window_us = static_cast<unsigned>(std::stoul(value));
+        }
+        else if (name == "batch-max-msgs")
+        {
+            config.batch_max_msgs = std::max<size_t>(1, std::stoul(value));
+        }
+        else if (name == "fan-out-chunk")
+        {
+            config.fan_out_chunk = std::stoul(value);
+        }
+        else if (name == "room-shards")
+        {
+            config.room_shards = std::max<size_t>(1, std::stoul(value));
+        }
+        else if (name == "core-ring-size")
+        {
+            config.core_ring_size = std::max<size_t>(2, std::stoul(value));
+        }
+        else
         {
-            port = std::atoi(argv[1]);
+            throw std::invalid_argument("unknown option " + arg);
         }
+    }
+
+    return config;
+}
+
+// Best effort; sessions still work unpinned if this fails
+void pin_to_core(std::thread &thread, size_t core)
+{
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core % CPU_SETSIZE, &cpus);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+#else
+    (void)thread;
+    (void)core;
+#endif
+}
+
+// All threads share one io_context and one acceptor
+void run_shared(const ServerConfig &config, ServerMetrics &metrics, size_t thread_count,
+                HistoryLog *history_log, SpillIo *spill_io)
+{
+    boost::asio::io_context io_context;
+    tcp::endpoint endpoint(tcp::v4(), config.port);
+    RoomRegistry rooms({&io_context}, config.room_shards,
+                       [&config, &metrics, history_log, thread_count](ChatRoom &room, size_t)
+                       {
+                           room.enable_shared_log(config.room_log_size);
+                           room.set_history_log(history_log);
+                           room.set_join_history(config.join_history);
+                           room.set_parallel_fan_out(config.fan_out_chunk, thread_count - 1);
+                           room.set_batching(std::chrono::microseconds(config.batch_window_us),
+                                             config.batch_max_msgs);
+                           room.set_metrics(metrics);
+                       });
+    ChatServer server(io_context, endpoint, rooms, 0, config, metrics, spill_io);
+    MetricsReporter reporter(io_context, config.stats_interval_sec, metrics);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < thread_count; ++i)
+    {
+        threads.emplace_back([&io_context]()
+                             { io_context.run(); });
+    }
+
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+}
+
+// One pinned thread, io_context, SO_REUSEPORT acceptor and copy of every
+// room per core. Copies share nothing; messages cross cores only through the
+// CoreBus rings and are routed to the same room on the other side.
+void run_per_core(const ServerConfig &config, ServerMetrics &metrics, size_t core_count,
+                  HistoryLog *history_log, SpillIo *spill_io)
+{
+    tcp::endpoint endpoint(tcp::v4(), config.port);
+    CoreBus bus(core_count, config.core_ring_size, metrics);
+
+    std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+    std::vector<boost::asio::io_context *> room_contexts;
+    for (size_t i = 0; i < core_count; ++i)
+    {
+        contexts.push_back(std::make_unique<boost::asio::io_context>(1));
+        room_contexts.push_back(contexts.back().get());
+    }
+
+    RoomRegistry rooms(room_contexts, config.room_shards,
+                       [&config, &metrics, &bus, history_log](ChatRoom &room, size_t core)
+                       {
+                           room.enable_shared_log(config.room_log_size);
+                           room.set_history_log(history_log);
+                           room.set_join_history(config.join_history);
+                           room.set_batching(std::chrono::microseconds(config.batch_window_us),
+                                             config.batch_max_msgs);
+                           room.set_metrics(metrics);
+                           // One thread per core, so fan-outs stay on the room's strand
+                           room.set_publisher([&bus, core](const message_ptr &msg)
+                                              { bus.publish(core, msg); });
+                       });
+
+    std::vector<std::unique_ptr<ChatServer>> servers;
+    for (size_t i = 0; i < core_count; ++i)
+    {
+        bus.attach(i, *contexts[i], [&rooms, i](const message_ptr &msg)
+                   {
+                       std::shared_ptr<ChatRoom> room = rooms.find(msg->room_id, i);
+                       if (room)
+                       {
+                           room->deliver_local(msg);
+                       }
+                   });
+
+        servers.push_back(std::make_unique<ChatServer>(*contexts[i], endpoint,
+                                                       rooms, i, config, metrics, spill_io));
+    }
+    MetricsReporter reporter(*contexts.front(), config.stats_interval_sec, metrics);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < core_count; ++i)
+    {
+        auto &io_context = *contexts[i];
+        threads.emplace_back([&io_context]()
+                             { io_context.run(); });
+        pin_to_core(threads.back(), i);
+    }
+
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        ServerConfig config = parse_args(argc, argv);
+        ServerMetrics metrics;
 
-        boost::asio::io_context io_context;
-        tcp::endpoint endpoint(tcp::v4(), port);
-        ChatServer server(io_context, endpoint);
+        size_t thread_count = config.threads ? config.threads
+                                             : std::thread::hardware_concurrency();
+        thread_count = std::max<size_t>(1, thread_count);
 
-        std::cout << "Chat Server starting on port " << port << "..." << std::endl;
+        std::cout << "Chat Server starting on port " << config.port << " with "
+                  << thread_count << (config.per_core ? " per-core loops" : " threads")
+                  << "..." << std::endl;
         std::cout << "Press Ctrl+C to stop the server." << std::endl;
 
-        // Run io_context in multiple threads for better performance
-        std::vector<std::thread> threads;
-        const size_t thread_count = std::thread::hardware_concurrency();
+        std::unique_ptr<HistoryLog> history_log;
+        if (!config.history_dir.empty())
+        {
+            history_log = std::make_unique<HistoryLog>(
+                config.history_dir, config.history_segment_bytes,
+                std::chrono::milliseconds(config.history_flush_ms), config.history_read_segments,
+                config.history_retain_segments, metrics.history);
+        }
 
-        for (size_t i = 0; i < thread_count; ++i)
+        std::unique_ptr<SpillIo> spill_io;
+        if (config.slow_consumer_policy == SlowConsumerPolicy::spill)
         {
-            threads.emplace_back([&io_context]()
-                                 { io_context.run(); });
+            spill_io = std::make_unique<SpillIo>();
         }
 
-        for (auto &t : threads)
+        if (config.per_core)
+        {
+            run_per_core(config, metrics, thread_count, history_log.get(), spill_io.get());
+        }
+        else
         {
-            t.join();
+            run_shared(config, metrics, thread_count, history_log.get(), spill_io.get());
         }
     }
     catch (std::exception &e)